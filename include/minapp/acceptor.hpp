@@ -3,18 +3,57 @@
 
 #include "service.hpp"
 
+#include <cstdint>
+#include <vector>
+
 namespace minapp
 {
     class MINAPP_API acceptor : public service
     {
     public:
+        /// How accepted sockets are spread over the context pool.
+        enum class balance
+        {
+            round_robin,
+            least_sessions,     ///< fewest sessions of this acceptor alive
+            hash_remote,        ///< the same remote endpoint always goes to the same context, @see balancer
+            reuse_port,         ///< a SO_REUSEPORT listener per context, the kernel spreads connections
+            reuse_port_cpu,     ///< as reuse_port, the listener of index cpu % pool size takes the
+                                ///< connections arrived on cpu, pair with contexts pinned to cpus
+        };
+
+        /// Index into pool of the context to run a socket accepted from @p remote. The remote is
+        /// known only once accepted, so hash_remote and a balancer accept every socket in pool[0]
+        /// and move it to its context by release() and assign(), paying a reactor deregister and
+        /// register per connection, with all accepts serialized by the reactor of pool[0]. Where
+        /// release() is not supported, e.g. on Windows, sockets stay in pool[0]. Prefer reuse_port
+        /// on Linux, where the kernel spreads connections over a listener per context.
+        using balancer = object::fn<std::size_t(const endpoint& remote)>;
+
         static acceptor_ptr create(handler_ptr handler, context_ptr ctx = {});
+
+        /// Accepted sessions run in contexts of @p pool, e.g. one single threaded context per
+        /// core so that sessions in different contexts never contend. pool[0] runs the listener.
+        static acceptor_ptr create(handler_ptr handler, std::vector<context_ptr> pool,
+                                   balance policy = balance::round_robin);
+        static acceptor_ptr create(handler_ptr handler, std::vector<context_ptr> pool, balancer policy);
+        const std::vector<context_ptr>& pool() const;
         acceptor_ptr shared_from_this();
+
+        /// Accepts in flight on each listener, set before bind(), 1 by default.
+        void pending_accepts(std::size_t n);
+        std::size_t pending_accepts() const;
+
+        /// Sockets accepted since creation, sample it for the accept rate.
+        std::uint64_t accepted() const;
+
+        /// Connections aborted before accepted are skipped, and running out of descriptors or
+        /// memory retries with backoff; other errors are thrown from the accepting context.
         void bind(const endpoint& ep);
         void unbind();
 
     private:
-        void accept();
+        void accept(std::size_t listener, unsigned backoff = 0);
     };
 }
 #endif
\ No newline at end of file
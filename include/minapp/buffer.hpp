@@ -1,10 +1,50 @@
 #ifndef MINAPP_BUFFER_HPP
 #define MINAPP_BUFFER_HPP
 
+#include "object.hpp"
+#include "persistent_buffer.hpp"
 #include <boost/asio/buffer.hpp>
 
+#include <cstring>
+#include <memory>
+#include <vector>
+
 namespace minapp
 {
+    /**
+     *  Allocator that default-initializes elements on value-less construction, so that
+     *  std::vector<char, default_init_allocator<char>>::resize() grows without zero-filling.
+     */
+    template<typename T, typename A = std::allocator<T>>
+    class default_init_allocator : public A
+    {
+        using traits = std::allocator_traits<A>;
+
+    public:
+        template<typename U>
+        struct rebind
+        {
+            using other = default_init_allocator<U, typename traits::template rebind_alloc<U>>;
+        };
+
+        using A::A;
+
+        template<typename U>
+        void construct(U* p) noexcept(std::is_nothrow_default_constructible_v<U>)
+        {
+            ::new(static_cast<void*>(p)) U;
+        }
+
+        template<typename U, typename... Args>
+        void construct(U* p, Args&&... args)
+        {
+            traits::construct(static_cast<A&>(*this), p, std::forward<Args>(args)...);
+        }
+    };
+
+    /// Complete frames parsed from the buffered input, @see protocol_options::batch_frames.
+    using buffer_span = object::vec<const boost::asio::mutable_buffer&>;
+
     class buffer : public boost::asio::mutable_buffer
     {
     protected:
@@ -16,73 +56,140 @@ namespace minapp
     public:
         inline boost::asio::mutable_buffer whole();
         inline buffer& consume(std::size_t n);
+
+        /// Share the storage of current frame, or of @p b within whole(), without copy. The
+        /// storage is not reused for later reads until every retained buffer is released.
+        inline persistent_buffer retain();
+        inline persistent_buffer retain(boost::asio::const_buffer b);
     };
 
     class triple_buffer : public buffer
     {
         /**
-         *   +----------------+----------------+--------+----------+
-         *   | external input | internal input | output | reserved |
-         *   +----------------+----------------+--------+----------+
+         *   +----------+----------------+----------------+--------+----------+
+         *   | consumed | external input | internal input | output | reserved |
+         *   +----------+----------------+----------------+--------+----------+
          *
+         *   consumed: consumed external input, reclaimed lazily by sliding the rest to the front
+         *             only when the output cannot be prepared within the current capacity
          *   external input: access from handler::read()
-         *   internal input: commit from output in asio::[async_]read_until() for DynamicBuffer_v1
-         *   output: fill by asio::[async_]read[_until](), should not contain any valid data since
+         *   internal input: bytes read but not yet framed, e.g. read ahead or scanned for delimiter
+         *   output: fill by asio::[async_]read[_some](), should not contain any valid data since
          *           it will be overwritten and callbacks of read should commit all valid data into
          *           the internal input buffer.
          *
-         *   @note internal input and output are used as a single buffer to support DynamicBuffer_v2.
+         *   @note all regions are adjacent in one chunk, a read fills output which is then committed
+         *         to the internal input, and framing moves bytes on to the external input in place.
+         *   @note output is not zero-filled when grown, its bytes are indeterminate until read into.
+         *   @note storage is a refcounted chunk shared by retained buffers. A shared chunk is never
+         *         moved within or reallocated, the rest of it is copied to a new chunk instead.
          */
-        std::vector<char> storage;
+        using chunk_type = std::vector<char, default_init_allocator<char>>;
+
+        object chunk;
+        char* chunk_data = nullptr;
+        std::size_t chunk_capacity = 0;
+        std::size_t used_size = 0;
+        std::size_t consumed_size = 0;
         std::size_t external_input_size = 0;
         std::size_t internal_input_size = 0;
 
+        char* begin()
+        {
+            return chunk_data + consumed_size;
+        }
+
+        // Move the first @p keep bytes from begin() to the front of a chunk of at least
+        // @p capacity bytes, the current one if not shared and large enough.
+        void rebase(std::size_t keep, std::size_t capacity)
+        {
+            if (capacity <= chunk_capacity && chunk.use_count() <= 1)
+            {
+                std::memmove(chunk_data, begin(), keep);
+            }
+            else
+            {
+                object next;
+                auto& data = next.emplace<chunk_type>((std::max)(capacity, chunk_capacity));
+                if (keep > 0) std::memcpy(data.data(), begin(), keep);
+                chunk = std::move(next);
+                chunk_data = data.data();
+                chunk_capacity = data.size();
+            }
+            used_size = keep;
+            consumed_size = 0;
+        }
+
+        // Make room for @p n bytes after the first @p keep bytes, sliding them to the front
+        // if the consumed bytes are needed or nothing has to be moved.
+        void reclaim(std::size_t keep, std::size_t n)
+        {
+            if (consumed_size == 0) return;
+            if (keep == 0 || chunk_capacity - consumed_size - keep < n)
+                rebase(keep, keep + n);
+        }
+
+        // Same as std::vector::resize() of the bytes from the front of chunk, but the consumed
+        // bytes are dropped when the chunk grows.
+        void resize(std::size_t n)
+        {
+            if (n > chunk_capacity)
+            {
+                const std::size_t consumed = consumed_size;
+                rebase(used_size - consumed, (std::max)(n - consumed, 2 * chunk_capacity));
+                n -= consumed;
+            }
+            used_size = n;
+        }
+
     public:
         using const_buffers_type = boost::asio::const_buffer;
         using mutable_buffers_type = boost::asio::mutable_buffer;
 
         std::size_t size() const
         {
-            return storage.size();
+            return used_size - consumed_size;
         }
 
         std::size_t max_size() const
         {
-            return storage.max_size();
+            return chunk_type().max_size();
         }
 
         std::size_t capacity() const
         {
-            return storage.capacity();
+            return chunk_capacity - consumed_size;
         }
 
         mutable_buffers_type output_buffer()
         {
             std::size_t sz = external_input_size + internal_input_size;
-            return boost::asio::buffer(storage.data() + sz, storage.size() - sz);
+            return boost::asio::buffer(begin() + sz, size() - sz);
         }
 
         mutable_buffers_type prepare_output_buffer(std::size_t n)
         {
             std::size_t sz = external_input_size + internal_input_size;
-            storage.resize(sz + n);
-            return boost::asio::buffer(storage.data() + sz, n);
+            reclaim(sz, n);
+            resize(consumed_size + sz + n);
+            return boost::asio::buffer(begin() + sz, n);
         }
 
         void grow_output_buffer(std::size_t n)
         {
-            storage.resize(storage.size() + n);
+            reclaim(size(), n);
+            resize(used_size + n);
         }
 
         void shrink_output_buffer(std::size_t n)
         {
             n = (std::min)(n, output_buffer().size());
-            storage.resize(storage.size() - n);
+            resize(used_size - n);
         }
 
         mutable_buffers_type internal_input_buffer()
         {
-            return boost::asio::buffer(storage.data() + external_input_size, internal_input_size);
+            return boost::asio::buffer(begin() + external_input_size, internal_input_size);
         }
 
         void commit_to_internal_input(std::size_t n)
@@ -104,7 +211,15 @@ namespace minapp
 
         mutable_buffers_type external_input_buffer()
         {
-            return boost::asio::buffer(storage.data(), external_input_size);
+            return boost::asio::buffer(begin(), external_input_size);
+        }
+
+        persistent_buffer retain(boost::asio::const_buffer b) const
+        {
+            persistent_buffer p;
+            p.storage() = chunk;
+            p.buffer() = b;
+            return p;
         }
 
         void commit_to_external_input(std::size_t n)
@@ -117,13 +232,21 @@ namespace minapp
         void consume_from_external_input(std::size_t n)
         {
             if(n > external_input_size) n = external_input_size;
-            storage.erase(storage.begin(), storage.begin() + n);
+            consumed_size += n;
             external_input_size -= n;
         }
 
+        // Move the end of external input to @p end within the external and internal input.
+        void external_input_end(const char* end)
+        {
+            internal_input_size += external_input_size;
+            external_input_size = 0;
+            if (end > begin()) commit_to_external_input(static_cast<std::size_t>(end - begin()));
+        }
+
         void consume_whole_external_input()
         {
-            storage.erase(storage.begin(), storage.begin() + external_input_size);
+            consumed_size += external_input_size;
             external_input_size = 0;
         }
 
@@ -144,6 +267,17 @@ namespace minapp
         return impl.external_input_buffer();
     }
 
+    persistent_buffer buffer::retain()
+    {
+        return retain(*this);
+    }
+
+    persistent_buffer buffer::retain(boost::asio::const_buffer b)
+    {
+        auto& impl = static_cast<triple_buffer&>(*this);
+        return impl.retain(b);
+    }
+
     buffer& buffer::consume(std::size_t n)
     {
         auto& impl = static_cast<triple_buffer&>(*this);
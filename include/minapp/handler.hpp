@@ -2,6 +2,7 @@
 #define MINAPP_HANDLER_HPP
 
 #include "fwd.hpp"
+#include "buffer.hpp"
 
 namespace minapp
 {
@@ -17,8 +18,15 @@ namespace minapp
 
         virtual void read(session* session, buffer& buf) {}
 
+        /// Frames of protocol_options::batch_frames, which session::retain() shares without copy.
+        /// Defaults to read(session*, buffer&) of each frame in turn.
+        virtual void read_batch(session* session, buffer_span frames);
+
         virtual void write(session* session, persistent_buffer_list& list) {}
 
+        /// Queued bytes of session rise to the high watermark or drain to the low watermark.
+        virtual void watermark(session* session, bool high) {}
+
         virtual void except(session* session, std::exception& e) {}
 
         virtual void error(session* session, boost::system::error_code ec) {}
@@ -43,8 +51,12 @@ namespace minapp
 
         void read(session* session, buffer& buf) noexcept override {}
 
+        void read_batch(session* session, buffer_span frames) noexcept override {}
+
         void write(session* session, persistent_buffer_list& list) noexcept override {}
 
+        void watermark(session* session, bool high) noexcept override {}
+
         void except(session* session, std::exception& e) noexcept override {}
 
         void error(session* session, boost::system::error_code ec) noexcept override {}
@@ -59,8 +71,12 @@ namespace minapp
 
         void read(session* session, buffer& buf) noexcept final;
 
+        void read_batch(session* session, buffer_span frames) noexcept final;
+
         void write(session* session, persistent_buffer_list& list) noexcept final;
 
+        void watermark(session* session, bool high) noexcept final;
+
         void except(session* session, std::exception& e) noexcept final;
 
         void error(session* session, boost::system::error_code ec) noexcept final;
@@ -72,8 +88,12 @@ namespace minapp
 
         virtual void read_impl(session* session, buffer& buf) {}
 
+        virtual void read_batch_impl(session* session, buffer_span frames);
+
         virtual void write_impl(session* session, persistent_buffer_list& list) {}
 
+        virtual void watermark_impl(session* session, bool high) {}
+
         virtual void except_impl(session* session, std::exception& e) {}
 
         virtual void error_impl(session* session, boost::system::error_code ec) {}
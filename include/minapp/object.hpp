@@ -91,7 +91,9 @@ protected:
 
     public:
         long addref(long c = 1) noexcept { return c + refcount.fetch_add(c, std::memory_order_relaxed); }
-        long release(long c = 1) noexcept { return addref(-c); }
+        // acq_rel such that accesses of other owners happen before the value is destroyed or reused
+        long release(long c = 1) noexcept { return refcount.fetch_sub(c, std::memory_order_acq_rel) - c; }
+        long use_count() const noexcept { return refcount.load(std::memory_order_acquire); }
         virtual ~placeholder() = default;
         [[nodiscard]] virtual type_index type() const noexcept = 0;
         [[noreturn]] virtual void throws() { throw nullptr; }
@@ -276,6 +278,11 @@ public:
         return p != nullptr;
     }
 
+    [[nodiscard]] long use_count() const noexcept
+    {
+        return p ? p->use_count() : 0;
+    }
+
     [[nodiscard]] type_index type() const noexcept
     {
         return p ? p->type() : null_t();
@@ -2,6 +2,8 @@
 #define MINAPP_PERSISTENT_BUFFER_HPP
 
 #include "object.hpp"
+#include <cstdint>
+#include <memory>
 #include <boost/intrusive/slist.hpp>
 #include <boost/asio/buffer.hpp>
 
@@ -53,12 +55,26 @@ namespace minapp
         const_buffer buffer() const { return *this; }
     };
 
+    /// Bytes [offset, offset + size) of an open file, written by sendfile() where available
+    /// instead of being read into memory. @p fd must stay open until handler::write() reports
+    /// the buffer, e.g. @p owner may hold a deleter which closes it.
+    struct file_region
+    {
+        int fd;
+        std::uint64_t offset;
+        std::uint64_t size;
+        std::shared_ptr<void> owner;
+    };
+
 
     /**
      *  @p object: using this object as the underlying storage and typename A specifies the actual type.
      * 
      *  @p persistent_buffer: copy persistent_buffer and @p n is the maximum of buffer size in bytes.
      *
+     *  @p file_region: buffer has no data but the size of region, no more than @p n bytes, and the region is
+     *                   copied into storage. The session writes it from the file in order with other buffers.
+     *
      *  @p pointer: buffer is exactly an @b array_with_length_n and data are copied into storage.
      *
      *  @p mutable_buffer: buffer is mutable_buffer with no more than @p n bytes and data are copied into storage.
@@ -96,6 +112,11 @@ namespace minapp
             buf = static_cast<persistent_buffer>(std::forward<C>(c));
             buf.buffer() = boost::asio::buffer(buf.buffer(), n);
         }
+        else if constexpr (std::is_same_v<NC, file_region>)
+        {
+            auto& storage = buf.storage().emplace<file_region>(std::forward<C>(c));
+            buf.buffer() = boost::asio::const_buffer(nullptr, static_cast<std::size_t>((std::min)(storage.size, std::uint64_t(n))));
+        }
         else if constexpr (std::is_pointer_v<NR>)
         {
             using NP = std::remove_pointer_t<NR>;
@@ -1,49 +1,71 @@
 #ifndef MINAPP_PERSISTENT_BUFFER_MANAGER_HPP
 #define MINAPP_PERSISTENT_BUFFER_MANAGER_HPP
 
-#include "spinlock.hpp"
 #include "persistent_buffer.hpp"
 
-#include <mutex>
-
-#include <boost/pool/pool.hpp>
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <limits>
+#include <memory>
 
 namespace minapp
 {
+    /**
+     *  Write queue of a session, an intrusive multi-producer/single-consumer queue
+     *  (@see http://www.1024cores.net/home/lock-free-algorithms/queues/intrusive-mpsc-node-based-queue).
+     *
+     *  Producers link buffers by a single atomic exchange and never wait for each other
+     *  or for the consumer. The consumer is whoever wins the busy flag in mark(), it moves
+     *  all linked buffers into the marked list and keeps the flag until clear_marked().
+     *  Nodes of buffers come from a small lock-free cache and then the free store.
+     */
     class persistent_buffer_manager
     {
-        boost::pool<> pool;
-        std::pair<persistent_buffer*, persistent_buffer*> cached_buffers_pool;
-        persistent_buffer_list cached_buffers_list;
-        persistent_buffer_list managed_buffers_list;
+        static constexpr std::size_t cache_line = 64;
+
+        struct node : persistent_buffer
+        {
+            std::atomic<node*> next{nullptr};
+        };
+
+        // producers
+        alignas(cache_line) std::atomic<node*> tail;
+        alignas(cache_line) std::atomic<std::uint64_t> cached_buffers_top;    // tag << 32 | (index + 1)
+
+        // consumer
+        alignas(cache_line) node* head;
         persistent_buffer_list marked_buffers_list;
-        spinlock pool_guard;
-        spinlock cached_buffers_list_guard;
-        spinlock managed_buffers_list_guard;
-        spinlock marked_buffers_list_guard;
-        long marker;
+        node stub;
+
+        // shared by producers and consumer
+        alignas(cache_line) std::atomic<bool> busy;
+        std::atomic<bool> pending;
+        std::atomic<long> marker;
+        std::atomic<std::size_t> bytes;
+
+        const std::unique_ptr<node[]> cached_buffers;
+        const std::uint32_t cached_buffers_size;
 
     public:
         explicit persistent_buffer_manager(unsigned cached = 8)
-            : pool(sizeof(persistent_buffer)), marker(0)
+            : tail(&stub), cached_buffers_top(0), head(&stub), busy(false), pending(false), marker(0), bytes(0),
+              cached_buffers(new node[cached]), cached_buffers_size(cached)
         {
-            persistent_buffer* p = (persistent_buffer*) pool.ordered_malloc(cached);
-            cached_buffers_pool.first = p;
-            cached_buffers_pool.second = p + cached;
-            while (p < cached_buffers_pool.second)
-                cached_buffers_list.push_front(*::new((void*)p++) persistent_buffer);
+            for (std::uint32_t i = 0; i < cached_buffers_size; ++i)
+                free_buffer(&cached_buffers[i]);
         }
 
         ////////////////////////////////////////////////////////////////////
-        /// manage() & mark() & marked() may be called in arbitrary threads,
-        /// but marked() & clear_marked() should be protected by marker such
+        /// manage() & mark() may be called in arbitrary threads, but
+        /// marked() & clear_marked() should be protected by marker such
         /// that no concurrent call to them.
         ////////////////////////////////////////////////////////////////////
         void manage(persistent_buffer& b)
         {
-            persistent_buffer& buf = hold_buffer(b);
-            std::lock_guard<spinlock> guard(managed_buffers_list_guard);
-            managed_buffers_list.push_back(buf);
+            node* n = hold_buffer(b);
+            bytes.fetch_add(n->size(), std::memory_order_relaxed);
+            push(n, n);
         }
 
         void manage(persistent_buffer&& b)
@@ -54,19 +76,22 @@ namespace minapp
         template<typename ...Buffers>
         std::enable_if_t<sizeof...(Buffers) >= 2> manage(Buffers&&... buffers)
         {
-            persistent_buffer_list tmp = make_list(hold_buffer(buffers)...);
-            std::lock_guard<spinlock> guard(managed_buffers_list_guard);
-            managed_buffers_list.splice(managed_buffers_list.end(), tmp);  // Constant time
+            node* first = nullptr;
+            node* last = nullptr;
+            ((void) link(first, last, hold_buffer(buffers)), ...);
+            bytes.fetch_add((buffers.size() + ...), std::memory_order_relaxed);
+            push(first, last);  // Buffers of one write are adjacent in the queue
         }
 
         void manage(persistent_buffer_list& list)
         {
-            persistent_buffer_list tmp;
+            node* first = nullptr;
+            node* last = nullptr;
+            std::size_t n = 0;
             for (persistent_buffer& b : list)
-                tmp.push_back(hold_buffer(b));
-
-            std::lock_guard<spinlock> guard(managed_buffers_list_guard);
-            managed_buffers_list.splice(managed_buffers_list.end(), tmp);  // Constant time
+                link(first, last, hold_buffer(b)), n += b.size();
+            bytes.fetch_add(n, std::memory_order_relaxed);
+            if (first) push(first, last);
         }
 
         void manage(persistent_buffer_list&& list)
@@ -74,14 +99,32 @@ namespace minapp
             return manage(list);
         }
 
+        /// Returns positive if buffers are marked and the caller should write them and then
+        /// clear_marked(), 0 if nothing to write, or negative if another caller is writing.
         long mark()
         {
-            std::lock_guard<spinlock> guard1(marked_buffers_list_guard);
-            if (!marked_buffers_list.empty()) return -marker;
-            std::lock_guard<spinlock> guard2(managed_buffers_list_guard);
-            if (managed_buffers_list.empty()) return 0;
-            marked_buffers_list.swap(managed_buffers_list);
-            return marker == std::numeric_limits<long>::max() ? marker = 1 : ++marker;
+            pending.exchange(true);
+            for (;;)
+            {
+                // the current consumer will see pending and drain the buffers of this caller
+                if (busy.exchange(true))
+                    return -(std::max)(marker.load(std::memory_order_relaxed), 1L);
+
+                pending.exchange(false);
+                while (node* n = pop())
+                    marked_buffers_list.push_back(*n);
+
+                if (!marked_buffers_list.empty())
+                {
+                    long m = marker.load(std::memory_order_relaxed);
+                    m = m == std::numeric_limits<long>::max() ? 1 : m + 1;
+                    marker.store(m, std::memory_order_relaxed);
+                    return m;
+                }
+
+                busy.exchange(false);
+                if (!pending.load()) return 0;
+            }
         }
 
         persistent_buffer_list& marked()
@@ -91,70 +134,124 @@ namespace minapp
 
         void clear_marked()
         {
-            marked_buffers_list.clear_and_dispose([this](persistent_buffer_list::pointer p)
+            std::size_t n = 0;
+            marked_buffers_list.clear_and_dispose([this, &n](persistent_buffer_list::pointer p)
             {
-                free_buffer(p);
+                n += p->size();
+                free_buffer(static_cast<node*>(p));
             });
+            bytes.fetch_sub(n, std::memory_order_relaxed);
+            busy.exchange(false);
+        }
+
+        /// Bytes managed and not cleared yet, including the marked.
+        std::size_t size() const
+        {
+            return bytes.load(std::memory_order_relaxed);
         }
 
         ~persistent_buffer_manager()
         {
-            auto deleter = [](persistent_buffer_list::pointer p)
-            {
-                p->~persistent_buffer();
-            };
+            while (node* n = pop())
+                marked_buffers_list.push_back(*n);
 
-            cached_buffers_list.clear_and_dispose(deleter);
-            managed_buffers_list.clear_and_dispose(deleter);
-            marked_buffers_list.clear_and_dispose(deleter);
+            marked_buffers_list.clear_and_dispose([this](persistent_buffer_list::pointer p)
+            {
+                auto n = static_cast<node*>(p);
+                if (!is_cached(n)) delete n;
+            });
         }
 
     private:
-        persistent_buffer& hold_buffer(persistent_buffer& b)
+        static void link(node*& first, node*& last, node* n)
+        {
+            if (last) last->next.store(n, std::memory_order_relaxed);
+            else first = n;
+            last = n;
+        }
+
+        void push(node* first, node* last)
         {
-            persistent_buffer* p = nullptr;
+            last->next.store(nullptr, std::memory_order_relaxed);
+            node* prev = tail.exchange(last, std::memory_order_acq_rel);
+            prev->next.store(first, std::memory_order_release);
+        }
 
+        // Returns nullptr if empty or the next node is being linked by a producer, who
+        // will call mark() after that.
+        node* pop()
+        {
+            node* h = head;
+            node* next = h->next.load(std::memory_order_acquire);
+            if (h == &stub)
             {
-                std::lock_guard<spinlock> guard(cached_buffers_list_guard);
-                if (!cached_buffers_list.empty())
-                {
-                    p = &cached_buffers_list.front();
-                    cached_buffers_list.pop_front();
-                }
+                if (next == nullptr) return nullptr;
+                head = h = next;
+                next = next->next.load(std::memory_order_acquire);
             }
-
-            if (p == nullptr)
+            if (next == nullptr)
             {
-                void* q = [this] {
-                    std::lock_guard<spinlock> guard(pool_guard);
-                    return pool.malloc();
-                }();
-                p = ::new(q) persistent_buffer{ b };
+                if (h != tail.load(std::memory_order_acquire)) return nullptr;
+                push(&stub, &stub);
+                next = h->next.load(std::memory_order_acquire);
+                if (next == nullptr) return nullptr;
             }
-            else
+            head = next;
+            return h;
+        }
+
+        bool is_cached(node* p) const
+        {
+            return p >= cached_buffers.get() && p < cached_buffers.get() + cached_buffers_size;
+        }
+
+        node* hold_buffer(persistent_buffer& b)
+        {
+            node* p = nullptr;
+
+            // the tag prevents ABA among producers popping concurrently
+            std::uint64_t top = cached_buffers_top.load(std::memory_order_acquire);
+            while (std::uint32_t index = static_cast<std::uint32_t>(top))
             {
-                *p = b;
+                node* n = &cached_buffers[index - 1];
+                node* next = n->next.load(std::memory_order_relaxed);
+                std::uint64_t tag = (top >> 32u) + 1;
+                std::uint64_t desired = tag << 32u | (is_cached(next) ? next - cached_buffers.get() + 1 : 0);
+                if (cached_buffers_top.compare_exchange_weak(top, desired,
+                        std::memory_order_acquire, std::memory_order_acquire))
+                {
+                    p = n;
+                    break;
+                }
             }
 
-            return *p;
+            if (p == nullptr) p = new node;
+            static_cast<persistent_buffer&>(*p) = b;
+            return p;
         }
 
-        void free_buffer(persistent_buffer* p)
+        void free_buffer(node* p)
         {
-            if (p >= cached_buffers_pool.first && p < cached_buffers_pool.second)
+            if (is_cached(p))
             {
                 p->storage() = {};
-                std::lock_guard<spinlock> guard(cached_buffers_list_guard);
-                cached_buffers_list.push_front(*p);
+                std::uint64_t top = cached_buffers_top.load(std::memory_order_relaxed);
+                std::uint64_t desired;
+                do
+                {
+                    auto index = static_cast<std::uint32_t>(top);
+                    p->next.store(index ? &cached_buffers[index - 1] : nullptr, std::memory_order_relaxed);
+                    desired = ((top >> 32u) + 1) << 32u | static_cast<std::uint64_t>(p - cached_buffers.get() + 1);
+                }
+                while (!cached_buffers_top.compare_exchange_weak(top, desired,
+                        std::memory_order_release, std::memory_order_relaxed));
             }
             else
             {
-                p->~persistent_buffer();
-                std::lock_guard<spinlock> guard(pool_guard);
-                pool.free(p);
+                delete p;
             }
         }
     };
 }
 
-#endif
\ No newline at end of file
+#endif
@@ -26,6 +26,8 @@ namespace minapp
         ignore_protocol_bytes = do_not_consume_buffer << 1,     // supports protocol::prefix_* and protocol::delim_*
         use_little_endian = ignore_protocol_bytes << 1,         // supports protocol::prefix_*
         include_prefix_in_payload = use_little_endian << 1,     // supports protocol::prefix_*
+        batch_frames = include_prefix_in_payload << 1,          // supports all protocols, deliver buffered frames
+                                                                // together by handler::read_batch()
     };
 
     inline unsigned to_integer(protocol_options o) { return static_cast<unsigned>(o); }
@@ -0,0 +1,102 @@
+#ifndef MINAPP_PUBSUB_HPP
+#define MINAPP_PUBSUB_HPP
+
+#include "fwd.hpp"
+#include "persistent_buffer.hpp"
+#include "spinlock.hpp"
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace minapp
+{
+    class pubsub;
+    using pubsub_ptr = std::shared_ptr<pubsub>;
+
+    /**
+     *  Topic to subscriber index shared by the sessions of one or more services. Publishing
+     *  queues the same buffers to every subscriber, sharing their storage by reference count,
+     *  e.g. a frame retained from the read buffer is written to all without a copy.
+     *
+     *  Topics are sharded by hash; publishers of a topic proceed together and only subscribe
+     *  and unsubscribe of the topic exclude them. All member functions are thread safe.
+     */
+    class MINAPP_API pubsub : public std::enable_shared_from_this<pubsub>
+    {
+    public:
+        /// What publish() does to a subscriber whose write queue holds more than its limit.
+        enum class slow_consumer
+        {
+            queue,          ///< queue anyway, the default
+            drop,           ///< skip the message for this subscriber
+            disconnect,     ///< close the session
+        };
+
+        /// Servlet of a subscribed session, @see session::servlet(). A destroyed session leaves
+        /// its topics as its servlet is destroyed.
+        class MINAPP_API subscriber
+        {
+            friend class pubsub;
+
+            spinlock guard_;
+            std::weak_ptr<pubsub> owner_;
+            std::vector<std::string> topics_;
+            std::atomic<slow_consumer> policy_{slow_consumer::queue};
+            std::atomic<std::size_t> limit_{0};
+            std::atomic<std::uint64_t> dropped_{0};
+
+        public:
+            subscriber() = default;
+            subscriber(const subscriber&) = delete;
+            subscriber& operator=(const subscriber&) = delete;
+            ~subscriber();
+
+            slow_consumer policy() const;
+            std::size_t limit() const;
+
+            /// Messages skipped by slow_consumer::drop.
+            std::uint64_t dropped() const;
+        };
+
+        static pubsub_ptr create();
+
+        void subscribe(session* session, std::string_view topic);
+        void unsubscribe(session* session, std::string_view topic);
+        void unsubscribe(session* session);
+
+        /// Policy applied when the queued bytes of @p session exceed @p limit, 0 for no limit.
+        void slow_consumer_policy(session* session, slow_consumer policy, std::size_t limit);
+
+        /// Returns the subscribers the buffers are queued to.
+        std::size_t publish(std::string_view topic, persistent_buffer_list& list);
+
+        std::size_t publish(std::string_view topic, persistent_buffer_list&& list)
+        {
+            return publish(topic, list);
+        }
+
+        template<typename ...Buffers>
+        std::size_t publish(std::string_view topic, Buffers&&... buffers)
+        {
+            persistent_buffer b[] = { persist(std::forward<Buffers>(buffers))... };
+            persistent_buffer_list list;
+            for (auto& e : b) list.push_back(e);
+            std::size_t n = publish(topic, list);
+            list.clear();
+            return n;
+        }
+
+        std::size_t subscribers(std::string_view topic);
+
+        /// Messages skipped by slow_consumer::drop of all subscribers.
+        std::uint64_t dropped() const;
+
+    private:
+        subscriber& servlet(session* session);
+    };
+}
+
+#endif
@@ -9,6 +9,16 @@
 
 namespace minapp
 {
+    /// Name of the reactor running sockets of contexts in this build, "io_uring" if minapp is
+    /// configured with MINAPP_IO_URING, otherwise "epoll", "kqueue", "iocp" or "select".
+    MINAPP_API const char* context_backend();
+
+    /// Context for acceptor::create() and connector::create(). @p threads is the number of
+    /// threads to run it, 0 if unknown. 1 is passed to asio as the concurrency hint, such that
+    /// the scheduler does not wake other threads for handlers queued while one runs. Locking is
+    /// kept, other threads still post to the context, e.g. writes, broadcast and the timers.
+    MINAPP_API context_ptr make_context(std::size_t threads = 0);
+
     class MINAPP_API service :
         public std::enable_shared_from_this<service>
     {
@@ -6,11 +6,20 @@
 #include "buffer.hpp"
 #include "protocol.hpp"
 #include "servlets.hpp"
+#include "spinlock.hpp"
 
 #include <future>
 #include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <list>
+#include <vector>
 
 #include <boost/asio/coroutine.hpp>
+#include <boost/asio/dispatch.hpp>
+#include <boost/asio/post.hpp>
+#include <boost/asio/steady_timer.hpp>
 
 namespace minapp
 {
@@ -37,36 +46,93 @@ namespace minapp
         closed,
     };
 
+    class timing_wheel;
+
     class MINAPP_API session
         : public std::enable_shared_from_this<session>,
           public boost::asio::coroutine,
           public servlets
     {
+        friend class handler;
         friend class service;
         friend class acceptor;
         friend class connector;
         friend class session_manager;
+        friend class timing_wheel;
 
     private:
         const unsigned long id_;
         const service_ptr service_;
+        const context_ptr context_;
         minapp::socket socket_;
         handler_ptr handler_;
         persistent_buffer_manager write_queue_;
         triple_buffer buf_;
+        std::vector<boost::asio::mutable_buffer> frames_;
         enum protocol protocol_;
         enum protocol_options protocol_options_;
         std::atomic<enum status> status_;
         std::size_t read_buffer_size_;
+        std::size_t read_ahead_size_;
+        std::size_t read_budget_;
         std::string delimiter_;
+        std::size_t delim_scanned_;
+        std::atomic<bool> cork_;
+        std::atomic<std::size_t> coalesce_threshold_;
+        std::atomic<std::uint64_t> bytes_coalesced_;
+        std::atomic<std::uint64_t> bytes_in_place_;
+        std::atomic<std::uint64_t> bytes_zerocopy_;
+        persistent_buffer_list::iterator write_cursor_;
+        std::vector<boost::asio::const_buffer> gather_;
+        std::vector<char, default_init_allocator<char>> coalesce_;
+        std::atomic<std::size_t> write_low_watermark_;
+        std::atomic<std::size_t> write_high_watermark_;
+        std::atomic<bool> write_blocked_;
+        std::atomic<bool> watermark_pending_;
+        std::atomic<bool> read_paused_;
+        std::atomic<bool> read_parked_;
+        std::weak_ptr<session> throttled_;
+        spinlock throttle_guard_;
+        session_ptr parked_;
+        struct relay_state;
+        std::shared_ptr<relay_state> relay_;
+        std::atomic<std::size_t> zerocopy_threshold_;
+        std::deque<std::pair<std::uint32_t, object>> zerocopy_pending_;
+        std::uint32_t zerocopy_next_;
+        bool zerocopy_enabled_;
+        bool zerocopy_armed_;
+        timing_wheel* const wheel_;
+        std::atomic<std::uint32_t> idle_timeout_;
+        std::atomic<std::uint32_t> read_timeout_;
+        std::atomic<std::uint32_t> write_timeout_;
+        std::atomic<std::uint64_t> idle_deadline_;
+        std::atomic<std::uint64_t> read_deadline_;
+        std::atomic<std::uint64_t> write_deadline_;
+        std::atomic<bool> wheel_filed_;
+        using timer_list = std::list<boost::asio::steady_timer>;
+        timer_list timers_;
+        timer_list idle_timers_;
+        std::atomic<std::size_t> timers_pending_;
 
     public:
-        explicit session(service_ptr service);
+        explicit session(service_ptr service, context_ptr ctx = {});
         ~session();
 
         unsigned long id() const;
         std::size_t read_buffer_size() const;
         void read_buffer_size(std::size_t sz);
+
+        /// Minimum bytes requested per read of protocol::fixed, protocol::prefix_* and
+        /// protocol::delim_*, such that following frames are parsed from the buffered input
+        /// without extra reads. 0 to read exactly the missing bytes of current fixed or prefix
+        /// frame, and at least 512 bytes for delim.
+        std::size_t read_ahead_size() const;
+        void read_ahead_size(std::size_t sz);
+
+        /// Maximum frames dispatched from buffered input in one turn before yielding the thread
+        /// to other sessions of the context, at least 1 and so 0 is taken as 1.
+        std::size_t read_budget() const;
+        void read_budget(std::size_t frames);
         const std::string& delimiter() const;
         void delimiter(char delim);
         void delimiter(std::string delim);
@@ -75,14 +141,126 @@ namespace minapp
         void protocol(enum protocol protocol, enum protocol_options options = {});
         void protocol(enum protocol protocol, std::size_t bufsz, enum protocol_options options = {});
         enum status status() const;
+
+        /// The executor of socket is a strand of the context, in which handler is called on I/O completion.
         minapp::socket& socket();
         const service_ptr& service() const;
         handler_ptr handler() const;
         handler_ptr handler(handler_ptr other);
         handler_ptr use_service_handler();
         void close(bool immediately = false);
+
+        /// Close the session immediately with handler::error() of boost::asio::error::timed_out
+        /// once nothing is read or written for @p timeout, 0 to disable. Thread safe. Timeouts
+        /// are kept by a timing wheel of the session manager in ticks of 100 ms, rounded up,
+        /// and I/O moves the deadline by a store without syscall or timer operation.
+        std::chrono::milliseconds idle_timeout() const;
+        void idle_timeout(std::chrono::milliseconds timeout);
+
+        /// As idle_timeout() once nothing is read for @p timeout, not counting while paused.
+        std::chrono::milliseconds read_timeout() const;
+        void read_timeout(std::chrono::milliseconds timeout);
+
+        /// As idle_timeout() once a write in flight makes no progress for @p timeout.
+        std::chrono::milliseconds write_timeout() const;
+        void write_timeout(std::chrono::milliseconds timeout);
+
+        /// Thread safe. Buffers are queued without lock, and at most one write is in flight
+        /// which is always started in the strand of socket().
         void write(persistent_buffer_list& list);
 
+        /// Buffers written while corked are only queued, and flushed in one gather write by
+        /// flush() or when the current handler callback of the session returns. Uncork flushes.
+        bool cork() const;
+        void cork(bool enable);
+
+        /// Start writing queued buffers if no write is in flight. Thread safe.
+        void flush();
+
+        /// Queued buffers smaller than threshold are copied together into a chunk reused by
+        /// the session and written as one, larger ones are written in place. 0 to never copy.
+        std::size_t coalesce_threshold() const;
+        void coalesce_threshold(std::size_t sz);
+
+        /// Bytes of gather writes copied into the chunk and passed in place respectively, to tune
+        /// threshold. Regions and buffers sent by MSG_ZEROCOPY are not counted.
+        std::uint64_t bytes_coalesced() const;
+        std::uint64_t bytes_in_place() const;
+
+        /// Buffers of at least @p sz bytes are sent by MSG_ZEROCOPY on Linux, and their storage is
+        /// held until the kernel releases the pages rather than until the write completes. Pays
+        /// off for multi-megabyte buffers only. 0 to disable, the default.
+        std::size_t zerocopy_threshold() const;
+        void zerocopy_threshold(std::size_t sz);
+
+        /// Bytes sent by MSG_ZEROCOPY, to tune zerocopy_threshold.
+        std::uint64_t bytes_zerocopy() const;
+
+        /// handler::watermark() is called when the queued bytes reach @p high, and again when
+        /// they drain to @p low after that. 0 high to disable.
+        std::size_t write_low_watermark() const;
+        std::size_t write_high_watermark() const;
+        void write_watermarks(std::size_t low, std::size_t high);
+
+        /// Bytes queued for write and not written yet.
+        std::size_t write_queue_size() const;
+
+        /// Pause reads of @p reader while the queued bytes of this session are above watermark,
+        /// e.g. the upstream of a relay writing to this session.
+        void throttle(std::weak_ptr<session> reader);
+
+        /// Stop re-arming reads and dispatching buffered frames, or resume them. Thread safe.
+        void pause_read();
+        void resume_read();
+
+        /// Move all bytes read from now on to @p peer, socket to pipe to socket by splice() on
+        /// Linux without copying to user space, otherwise through pooled chunks. Bytes buffered
+        /// and not framed yet go first, and frames are no longer dispatched to handler::read().
+        /// Call in the callbacks of this session, once for each direction of a pair.
+        void relay(session_ptr peer);
+
+        /// Run @p f in the strand of socket(), serialized with the handler callbacks of this session,
+        /// unless closed by then. Thread safe. @p f is passed to asio as the handler without type
+        /// erasure, and allocated by the recycling allocator of asio as I/O completions are, which
+        /// caches small blocks per thread, so large captures still allocate.
+        template<typename F>
+        void post(F&& f)
+        {
+            boost::asio::post(socket_.get_executor(), deferred(std::forward<F>(f)));
+        }
+
+        /// As post() but run @p f inline if called in the strand of socket().
+        template<typename F>
+        void dispatch(F&& f)
+        {
+            boost::asio::dispatch(socket_.get_executor(), deferred(std::forward<F>(f)));
+        }
+
+        /// Run @p f in the strand of socket() after @p delay unless closed by then, close()
+        /// cancels the timers pending. Thread safe. Timers are reused by the session.
+        template<typename F>
+        void after(std::chrono::steady_clock::duration delay, F&& f)
+        {
+            boost::asio::dispatch(socket_.get_executor(),
+            [self = shared_from_this(), delay, f = std::forward<F>(f)]() mutable
+            {
+                // counted before checked, close() sees either of them
+                self->timers_pending_.fetch_add(1);
+                if (self->status_ >= status::closed) return (void)self->timers_pending_.fetch_sub(1);
+                auto timer = self->acquire_timer();
+                timer->expires_after(delay);
+                timer->async_wait([self, timer, f = std::move(f)](const boost::system::error_code& ec) mutable
+                {
+                    self->release_timer(timer);
+                    if (!ec && self->status_ < status::closed) f();
+                });
+            });
+        }
+
+        /// Share the storage of @p frame without copy as buffer::retain(), e.g. a frame of the
+        /// batch passed to handler::read_batch(). Call in handler::read() or read_batch() only.
+        persistent_buffer retain(boost::asio::const_buffer frame);
+
         void write(persistent_buffer_list&& list)
         {
             write(list);
@@ -93,7 +271,7 @@ namespace minapp
         {
             if (status_ >= status::closing) return;
             write_queue_.manage(persist(std::forward<Buffers>(buffers))...);
-            write();
+            queued();
         }
 
         template<typename T>
@@ -114,19 +292,56 @@ namespace minapp
             return servlet<T>(instance, op);
         }
 
-    private:
+    protected:
         context& execution_context() const;
+
+    private:
         bool check(const boost::system::error_code& ec);
+        void timeout(std::atomic<std::uint32_t>& timeout, std::atomic<std::uint64_t>* deadline,
+                     std::chrono::milliseconds value);
+        void touch(bool read, bool write);
+        std::uint64_t deadline() const;
+        void expire();
+        timer_list::iterator acquire_timer();
+        void release_timer(timer_list::iterator timer);
+        void cancel_timers();
+
+        template<typename F>
+        auto deferred(F&& f)
+        {
+            return [self = shared_from_this(), f = std::forward<F>(f)]() mutable
+            {
+                if (self->status_ < status::closed) f();
+            };
+        }
         std::future<session_ptr> connect(const endpoint& ep);
         std::future<session_ptr> connect(object::fn<endpoint()> gen);
         bool connect(const boost::system::error_code& ec, std::promise<session_ptr>* promise);
-        void write();
+        void queued();
+        void write_marked();
+        void write_batch();
+        void write_next();
+        void write_region();
+        void splice_region(std::size_t remaining);
+        void sendfile_region(std::size_t sent);
+        void pread_region(std::size_t sent);
+        bool zerocopy();
+        void zerocopy_send(std::size_t offset);
+        void zerocopy_reap();
+        void watermark();
         void read();
-        void read_some(std::size_t bufsize);
-        void read_fixed(std::size_t bufsize);
-        void read_delim(char delim);
-        void read_delim(const std::string& delim);
-        void read_prefix(std::size_t len);
+        void read_frames();
+        void relay_read();
+        void relay_splice(const session_ptr& peer);
+        void relay_copy();
+        void dispatch_frame();
+        bool deliver();
+        bool read_some(std::size_t bufsize);
+        bool read_fixed(std::size_t bufsize);
+        bool read_delim(char delim);
+        bool read_delim(const std::string& delim);
+        bool read_delim(const char* delim, std::size_t delim_length);
+        bool read_prefix(std::size_t len);
     };
 }
 
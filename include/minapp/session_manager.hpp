@@ -3,6 +3,10 @@
 
 #include "fwd.hpp"
 #include "object.hpp"
+#include "persistent_buffer.hpp"
+
+#include <future>
+#include <vector>
 
 namespace minapp
 {
@@ -13,15 +17,40 @@ namespace minapp
         static session_manager_ptr create();
 
         session_ptr create(service_ptr service);
+
+        /// Session running in @p ctx rather than the context of @p service.
+        session_ptr create(service_ptr service, context_ptr ctx);
         session_ptr get(unsigned long id);
 
+        /// Sessions alive in @p ctx.
+        std::size_t size(const context& ctx);
+
+        /// Sessions alive at the call, collected in one pass without blocking create or close.
+        std::vector<session_ptr> snapshot();
+
         /*
             bool f(session* session)
             return value:
                 true: continue;
                 false: stop.
+            called on a snapshot(), sessions created meanwhile are not visited.
         */
         std::size_t foreach(object::fn<bool(&)(session*)> f);
+
+        /// As foreach() but f is called concurrently by the calling thread and threads running
+        /// @p pool, each on chunks of the snapshot; false from f stops the other chunks too.
+        /// The first exception thrown by f also stops them and is rethrown once all have finished.
+        std::size_t foreach(object::fn<bool(&)(session*)> f, context& pool);
+
+        /// Queue @p list to every session, or to those @p filter returns true for, in the calling
+        /// thread. Buffers are shared by reference count and not copied, a recipient costs a queue
+        /// node per buffer. Returns the number of recipients.
+        std::size_t broadcast(persistent_buffer_list& list);
+        std::size_t broadcast(persistent_buffer_list& list, object::fn<bool(&)(session*)> filter);
+
+        /// As broadcast() but the sessions of each context are filtered and written by a task
+        /// posted to that context, in parallel among contexts. @p list may be reused on return.
+        std::future<std::size_t> async_broadcast(persistent_buffer_list& list, object::fn<bool(session*)> filter = {});
     };
 }
 
@@ -1,5 +1,6 @@
 #include <minapp/handler.hpp>
 #include <minapp/service.hpp>
+#include <minapp/session.hpp>
 
 using namespace minapp;
 
@@ -13,6 +14,7 @@ namespace
         unknown_except_exception,
         unknown_error_exception,
         unknown_close_exception,
+        unknown_watermark_exception,
     };
 
     class runtime_category : public boost::system::error_category
@@ -40,6 +42,7 @@ namespace
                 MINAPP_RUNTIME_CATEGORY_ERROR_MESSAGE(except);
                 MINAPP_RUNTIME_CATEGORY_ERROR_MESSAGE(error);
                 MINAPP_RUNTIME_CATEGORY_ERROR_MESSAGE(close);
+                MINAPP_RUNTIME_CATEGORY_ERROR_MESSAGE(watermark);
                 default: break;
             }
             return "runtime error";
@@ -55,6 +58,22 @@ handler_ptr handler::dummy()
     return dummy_handler;
 }
 
+void handler::read_batch(session* session, buffer_span frames)
+{
+    // as if protocol_options::batch_frames were not set, whole() ends with the current frame
+    auto& buf = session->buf_;
+    const bool consume = !has_options(session->protocol_options_, protocol_options::do_not_consume_buffer);
+    auto whole = buf.external_input_buffer();
+    for (auto& frame : frames)
+    {
+        buf.external_input_end(static_cast<const char*>(frame.data()) + frame.size());
+        static_cast<boost::asio::mutable_buffer&>(buf) = frame;
+        read(session, buf);
+        if (consume) buf.consume_whole_external_input();
+    }
+    buf.external_input_end(static_cast<const char*>(whole.data()) + whole.size());
+}
+
 handler_ptr noexcept_handler::wrapped() noexcept
 {
     return {};
@@ -92,6 +111,28 @@ void noexcept_handler_impl::read(session* session, buffer& buf) noexcept
     }
 }
 
+void noexcept_handler_impl::read_batch(session* session, buffer_span frames) noexcept
+{
+    try
+    {
+        read_batch_impl(session, frames);
+    }
+    catch (std::exception& e)
+    {
+        except(session, e);
+    }
+    catch (...)
+    {
+        error(session, boost::system::error_code(unknown_read_exception, runtime_category::instance()));
+    }
+}
+
+void noexcept_handler_impl::read_batch_impl(session* session, buffer_span frames)
+{
+    // each frame through read() and so read_impl(), with exceptions of them caught per frame
+    handler::read_batch(session, frames);
+}
+
 void noexcept_handler_impl::write(session* session, persistent_buffer_list& list) noexcept
 {
     try
@@ -108,6 +149,22 @@ void noexcept_handler_impl::write(session* session, persistent_buffer_list& list
     }
 }
 
+void noexcept_handler_impl::watermark(session* session, bool high) noexcept
+{
+    try
+    {
+        watermark_impl(session, high);
+    }
+    catch (std::exception& e)
+    {
+        except(session, e);
+    }
+    catch (...)
+    {
+        error(session, boost::system::error_code(unknown_watermark_exception, runtime_category::instance()));
+    }
+}
+
 void noexcept_handler_impl::except(session* session, std::exception& e) noexcept
 {
     try
@@ -179,11 +236,21 @@ std::shared_ptr<noexcept_handler> noexcept_handler::wrap(handler_ptr handler)
                     handler_->read(session, buf);
                 }
 
+                void read_batch_impl(session* session, buffer_span frames) override
+                {
+                    handler_->read_batch(session, frames);
+                }
+
                 void write_impl(session* session, persistent_buffer_list& list) override
                 {
                     handler_->write(session, list);
                 }
 
+                void watermark_impl(session* session, bool high) override
+                {
+                    handler_->watermark(session, high);
+                }
+
                 void except_impl(session* session, std::exception& e) override
                 {
                     handler_->except(session, e);
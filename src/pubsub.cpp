@@ -0,0 +1,241 @@
+#include <minapp/pubsub.hpp>
+#include <minapp/session.hpp>
+
+#include <algorithm>
+#include <functional>
+#include <mutex>
+#include <shared_mutex>
+#include <unordered_map>
+
+using namespace minapp;
+
+namespace
+{
+    struct topic
+    {
+        struct entry
+        {
+            std::weak_ptr<session> weak;
+            pubsub::subscriber* sub;    // valid while weak can be locked
+        };
+
+        std::shared_mutex guard;
+        std::vector<entry> entries;
+        bool dead = false;      // erased from its shard, subscribe to a new one
+    };
+
+    using topic_ptr = std::shared_ptr<topic>;
+
+    struct shard
+    {
+        spinlock guard;
+        std::unordered_map<std::string, topic_ptr> topics;
+    };
+
+    class pubsub_impl : public pubsub
+    {
+    public:
+        static constexpr std::size_t shards = 64;
+        shard shards_[shards];
+        std::atomic<std::uint64_t> dropped_{0};
+
+        shard& of(std::string_view name)
+        {
+            return shards_[std::hash<std::string_view>{}(name) % shards];
+        }
+
+        topic_ptr find(std::string_view name)
+        {
+            shard& sh = of(name);
+            std::lock_guard<spinlock> guard(sh.guard);
+            auto it = sh.topics.find(std::string(name));
+            return it == sh.topics.end() ? topic_ptr{} : it->second;
+        }
+
+        topic_ptr find_or_create(std::string_view name)
+        {
+            shard& sh = of(name);
+            std::lock_guard<spinlock> guard(sh.guard);
+            auto& t = sh.topics[std::string(name)];
+            if (!t) t = std::make_shared<topic>();
+            return t;
+        }
+
+        // the subscriber guarantees that a session is added once
+        void add(std::string_view name, std::weak_ptr<session> s, subscriber* sub)
+        {
+            for (;;)
+            {
+                topic_ptr t = find_or_create(name);
+                std::unique_lock<std::shared_mutex> lock(t->guard);
+                if (t->dead) continue;
+                t->entries.push_back({std::move(s), sub});
+                return;
+            }
+        }
+
+        // also prunes the expired entries of other sessions
+        void remove(std::string_view name, const subscriber* sub)
+        {
+            if (topic_ptr t = find(name))
+            {
+                std::unique_lock<std::shared_mutex> lock(t->guard);
+                erase(name, *t, [sub](const topic::entry& e) { return e.sub == sub || e.weak.expired(); });
+            }
+        }
+
+        // called with the topic locked
+        template<typename Pred>
+        void erase(std::string_view name, topic& t, Pred pred)
+        {
+            t.entries.erase(std::remove_if(t.entries.begin(), t.entries.end(), pred), t.entries.end());
+            if (t.entries.empty() && !t.dead)
+            {
+                // no subscriber can be added meanwhile, they wait for the topic lock held here
+                shard& sh = of(name);
+                std::lock_guard<spinlock> guard(sh.guard);
+                sh.topics.erase(std::string(name));
+                t.dead = true;
+            }
+        }
+    };
+}
+
+pubsub::subscriber::~subscriber()
+{
+    // the session is gone, no publish() to these topics may follow to prune it
+    if (auto owner = owner_.lock())
+        for (auto& t : topics_) static_cast<pubsub_impl*>(owner.get())->remove(t, this);
+}
+
+pubsub::slow_consumer pubsub::subscriber::policy() const
+{
+    return policy_.load(std::memory_order_relaxed);
+}
+
+std::size_t pubsub::subscriber::limit() const
+{
+    return limit_.load(std::memory_order_relaxed);
+}
+
+std::uint64_t pubsub::subscriber::dropped() const
+{
+    return dropped_.load(std::memory_order_relaxed);
+}
+
+pubsub_ptr pubsub::create()
+{
+    return std::make_shared<pubsub_impl>();
+}
+
+pubsub::subscriber& pubsub::servlet(session* session)
+{
+    return session->servlet<subscriber>();
+}
+
+void pubsub::subscribe(session* session, std::string_view topic)
+{
+    subscriber& sub = servlet(session);
+    {
+        std::lock_guard<spinlock> guard(sub.guard_);
+        if (std::find(sub.topics_.begin(), sub.topics_.end(), topic) != sub.topics_.end()) return;
+        sub.topics_.emplace_back(topic);
+        sub.owner_ = weak_from_this();
+    }
+    static_cast<pubsub_impl*>(this)->add(topic, session->weak_from_this(), &sub);
+}
+
+void pubsub::unsubscribe(session* session, std::string_view topic)
+{
+    subscriber& sub = servlet(session);
+    {
+        std::lock_guard<spinlock> guard(sub.guard_);
+        auto it = std::find(sub.topics_.begin(), sub.topics_.end(), topic);
+        if (it == sub.topics_.end()) return;
+        sub.topics_.erase(it);
+    }
+    static_cast<pubsub_impl*>(this)->remove(topic, &sub);
+}
+
+void pubsub::unsubscribe(session* session)
+{
+    subscriber& sub = servlet(session);
+    std::vector<std::string> topics;
+    {
+        std::lock_guard<spinlock> guard(sub.guard_);
+        topics.swap(sub.topics_);
+    }
+    for (auto& t : topics) static_cast<pubsub_impl*>(this)->remove(t, &sub);
+}
+
+void pubsub::slow_consumer_policy(session* session, slow_consumer policy, std::size_t limit)
+{
+    subscriber& sub = servlet(session);
+    sub.policy_.store(policy, std::memory_order_relaxed);
+    sub.limit_.store(limit, std::memory_order_relaxed);
+}
+
+std::size_t pubsub::publish(std::string_view name, persistent_buffer_list& list)
+{
+    auto impl = static_cast<pubsub_impl*>(this);
+    topic_ptr t = impl->find(name);
+    if (!t) return 0;
+
+    // Live subscribers are only collected under the lock. A reference dropped there may be the
+    // last one, whose close handler may unsubscribe and lock the topic again, and a write may
+    // run handler callbacks inline, so both happen after the lock is released.
+    std::vector<std::pair<session_ptr, subscriber*>> live;
+    std::size_t expired = 0;
+    {
+        std::shared_lock<std::shared_mutex> lock(t->guard);
+        live.reserve(t->entries.size());
+        for (auto& e : t->entries)
+        {
+            if (auto session = e.weak.lock()) live.emplace_back(std::move(session), e.sub);
+            else ++expired;
+        }
+    }
+    if (expired > 0)
+    {
+        std::unique_lock<std::shared_mutex> lock(t->guard);
+        impl->erase(name, *t, [](const topic::entry& e) { return e.weak.expired(); });
+    }
+
+    std::size_t c = 0;
+    for (auto& [session, sub] : live)
+    {
+        std::size_t limit = sub->limit();
+        if (limit > 0 && session->write_queue_size() > limit)
+        {
+            auto policy = sub->policy();
+            if (policy == slow_consumer::drop)
+            {
+                sub->dropped_.fetch_add(1, std::memory_order_relaxed);
+                impl->dropped_.fetch_add(1, std::memory_order_relaxed);
+                continue;
+            }
+            if (policy == slow_consumer::disconnect)
+            {
+                // in the strand of the subscriber, like its reads, writes and timers
+                session->dispatch([s = session.get()] { s->close(true); });
+                continue;
+            }
+        }
+        session->write(list);
+        ++c;
+    }
+    return c;
+}
+
+std::size_t pubsub::subscribers(std::string_view name)
+{
+    topic_ptr t = static_cast<pubsub_impl*>(this)->find(name);
+    if (!t) return 0;
+    std::shared_lock<std::shared_mutex> lock(t->guard);
+    return t->entries.size();
+}
+
+std::uint64_t pubsub::dropped() const
+{
+    return static_cast<const pubsub_impl*>(this)->dropped_.load(std::memory_order_relaxed);
+}
@@ -5,7 +5,25 @@
 #include <minapp/connector.hpp>
 #include <minapp/acceptor.hpp>
 
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <functional>
+#include <string_view>
+
+#if defined(__linux__)
+#  include <sys/socket.h>
+#  include <linux/filter.h>
+#  if defined(SO_ATTACH_REUSEPORT_CBPF)
+#    define MINAPP_HAS_REUSEPORT_CBPF 1
+#  endif
+#endif
+
 #include <boost/asio/basic_socket_acceptor.hpp>
+#include <boost/asio/dispatch.hpp>
+#include <boost/asio/steady_timer.hpp>
+#include <boost/asio/strand.hpp>
 
 using namespace minapp;
 
@@ -41,6 +59,27 @@ namespace
     };
 }
 
+const char* minapp::context_backend()
+{
+#if defined(BOOST_ASIO_HAS_IO_URING_AS_DEFAULT)
+    return "io_uring";
+#elif defined(BOOST_ASIO_HAS_IOCP)
+    return "iocp";
+#elif defined(BOOST_ASIO_HAS_EPOLL)
+    return "epoll";
+#elif defined(BOOST_ASIO_HAS_KQUEUE)
+    return "kqueue";
+#else
+    return "select";
+#endif
+}
+
+context_ptr minapp::make_context(std::size_t threads)
+{
+    if (threads == 1) return std::make_shared<::context>(1);
+    return std::make_shared<::context>();
+}
+
 service::~service() = default;
 
 const handler_ptr& service::handler()
@@ -117,7 +156,7 @@ namespace
         endpoint remote_;
 
         connector_impl(const endpoint& remote, handler_ptr handler, context_ptr ctx)
-            : guard_(boost::asio::make_work_guard(ctx ? *ctx : *(ctx = std::make_shared<::context>())))
+            : guard_(boost::asio::make_work_guard(ctx ? *ctx : *(ctx = make_context())))
         {
             remote_ = remote;
             context_ = std::move(ctx);
@@ -172,23 +211,148 @@ namespace
     class acceptor_impl : public acceptor
     {
     public:
-        boost::asio::basic_socket_acceptor<boost::asio::generic::stream_protocol> acceptor_;
-        boost::asio::executor_work_guard<context::executor_type> guard_;
-
-        acceptor_impl(handler_ptr handler, context_ptr ctx)
-            : acceptor_(ctx ? *ctx : *(ctx = std::make_shared<::context>())),
-              guard_(boost::asio::make_work_guard(*ctx))
+        // one listener, or one per context of the pool for reuse_port
+        std::vector<boost::asio::basic_socket_acceptor<boost::asio::generic::stream_protocol>> listeners_;
+        std::vector<boost::asio::executor_work_guard<context::executor_type>> guards_;
+        std::vector<context_ptr> pool_;
+        balance policy_;
+        balancer balancer_;
+        std::atomic<std::size_t> next_;
+        std::size_t pending_;
+        std::atomic<std::uint64_t> accepted_;
+        std::atomic<bool> bound_;
+
+        acceptor_impl(handler_ptr handler, std::vector<context_ptr> pool, balance policy, balancer b)
+            : pool_(std::move(pool)), policy_(policy), balancer_(std::move(b)), next_(0),
+              pending_(1), accepted_(0), bound_(false)
         {
-            context_ = std::move(ctx);
+            listeners_.emplace_back(*pool_.at(0));
+            if (reuse_port())
+                for (std::size_t i = 1; i < pool_.size(); ++i)
+                    listeners_.emplace_back(*pool_[i]);
+            // every context of the pool keeps running until sessions are moved in
+            guards_.reserve(pool_.size());
+            for (const auto& ctx : pool_)
+                guards_.push_back(boost::asio::make_work_guard(*ctx));
+            context_ = pool_[0];
             handler_ = noexcept_handler::wrap(std::move(handler));
             manager_ = session_manager::create();
         }
+
+        bool reuse_port() const
+        {
+            return !balancer_ && (policy_ == balance::reuse_port || policy_ == balance::reuse_port_cpu);
+        }
+
+        // context of the next socket of @p listener if it is known before accept
+        context_ptr pick(std::size_t listener)
+        {
+            if (listener > 0) return pool_[listener];
+            if (pool_.size() == 1 || balancer_) return context_;
+            switch (policy_)
+            {
+            case balance::round_robin:
+                return pool_[next_.fetch_add(1, std::memory_order_relaxed) % pool_.size()];
+            case balance::least_sessions:
+                return *std::min_element(pool_.begin(), pool_.end(), [this](const auto& a, const auto& b)
+                {
+                    return manager_->size(*a) < manager_->size(*b);
+                });
+            default:
+                return context_;
+            }
+        }
+
+        // context of an accepted socket which depends on its remote endpoint
+        context_ptr pick(const minapp::socket& s)
+        {
+            if (pool_.size() == 1 || (!balancer_ && policy_ != balance::hash_remote)) return {};
+            boost::system::error_code ec;
+            endpoint remote = s.remote_endpoint(ec);
+            if (ec) return {};
+            if (balancer_) return pool_[balancer_(remote) % pool_.size()];
+            std::string_view bytes(reinterpret_cast<const char*>(remote.data()), remote.size());
+            return pool_[std::hash<std::string_view>{}(bytes) % pool_.size()];
+        }
+
+        // milliseconds to wait before accepting again after @p ec, 0 to accept at once, -1 if fatal.
+        // @p backoff is of one pending accept, such that a burst of errors doubles it once each.
+        int retry(const boost::system::error_code& ec, unsigned& backoff)
+        {
+            namespace errc = boost::system::errc;
+            if (ec.category() != boost::system::system_category() && ec.category() != boost::system::generic_category())
+                return -1;
+            switch (ec.value())
+            {
+            // the pending connection is gone or refused, see accept(2) for errors passed on by linux
+            case errc::connection_aborted:
+            case errc::interrupted:
+            case errc::operation_would_block:
+            case errc::protocol_error:
+            case errc::permission_denied:
+            case errc::operation_not_permitted:
+            case errc::network_down:
+            case errc::network_unreachable:
+            case errc::host_unreachable:
+            case errc::no_protocol_option:
+            case errc::operation_not_supported:
+#if defined(EHOSTDOWN)
+            case EHOSTDOWN:
+#endif
+#if defined(ENONET)
+            case ENONET:
+#endif
+                return 0;
+            // connections stay queued until descriptors or memory are released
+            case errc::too_many_files_open:
+            case errc::too_many_files_open_in_system:
+            case errc::no_buffer_space:
+            case errc::not_enough_memory:
+            {
+                backoff = backoff == 0 ? 1 : (std::min)(backoff * 2, 1000u);
+                return static_cast<int>(backoff);
+            }
+            default:
+                return -1;
+            }
+        }
     };
 }
 
 acceptor_ptr acceptor::create(handler_ptr handler, context_ptr ctx)
 {
-    return std::make_shared<acceptor_impl>(std::move(handler), std::move(ctx));
+    return std::make_shared<acceptor_impl>(std::move(handler), std::vector<context_ptr>{ctx ? std::move(ctx) : make_context()},
+                                           balance::round_robin, balancer{});
+}
+
+acceptor_ptr acceptor::create(handler_ptr handler, std::vector<context_ptr> pool, balance policy)
+{
+    return std::make_shared<acceptor_impl>(std::move(handler), std::move(pool), policy, balancer{});
+}
+
+acceptor_ptr acceptor::create(handler_ptr handler, std::vector<context_ptr> pool, balancer policy)
+{
+    return std::make_shared<acceptor_impl>(std::move(handler), std::move(pool), balance::round_robin, std::move(policy));
+}
+
+const std::vector<context_ptr>& acceptor::pool() const
+{
+    return static_cast<const acceptor_impl*>(this)->pool_;
+}
+
+void acceptor::pending_accepts(std::size_t n)
+{
+    static_cast<acceptor_impl*>(this)->pending_ = (std::max)(n, std::size_t(1));
+}
+
+std::size_t acceptor::pending_accepts() const
+{
+    return static_cast<const acceptor_impl*>(this)->pending_;
+}
+
+std::uint64_t acceptor::accepted() const
+{
+    return static_cast<const acceptor_impl*>(this)->accepted_.load(std::memory_order_relaxed);
 }
 
 std::shared_ptr<acceptor> acceptor::shared_from_this()
@@ -198,45 +362,116 @@ std::shared_ptr<acceptor> acceptor::shared_from_this()
 
 void acceptor::bind(const endpoint& ep)
 {
-    auto& acceptor_ = static_cast<acceptor_impl*>(this)->acceptor_;
-    acceptor_.open(ep.protocol());
+    auto impl = static_cast<acceptor_impl*>(this);
+    bool inet = false;
     switch (ep.protocol().family())
     {
     case BOOST_ASIO_OS_DEF(AF_INET):
     case BOOST_ASIO_OS_DEF(AF_INET6):
-        acceptor_.set_option(socket::reuse_address(true));
+        inet = true;
         break;
     default:
         break;
     }
-    acceptor_.bind(ep);
-    acceptor_.listen();
-    accept();
+    // other families cannot share an address, the first listener takes all connections
+    std::size_t n = inet ? impl->listeners_.size() : 1;
+    for (std::size_t i = 0; i < n; ++i)
+    {
+        auto& acceptor_ = impl->listeners_[i];
+        acceptor_.open(ep.protocol());
+        if (inet) acceptor_.set_option(socket::reuse_address(true));
+        if (inet && impl->reuse_port())
+        {
+#if defined(SO_REUSEPORT)
+            acceptor_.set_option(boost::asio::detail::socket_option::boolean<SOL_SOCKET, SO_REUSEPORT>(true));
+#else
+            throw boost::system::system_error(make_error_code(boost::system::errc::operation_not_supported));
+#endif
+        }
+        // an ephemeral port of the first listener is shared by the others
+        acceptor_.bind(i == 0 ? ep : impl->listeners_[0].local_endpoint());
+    }
+    if (inet && impl->reuse_port() && impl->policy_ == balance::reuse_port_cpu && n > 1)
+    {
+#if MINAPP_HAS_REUSEPORT_CBPF
+        // listeners are indexed in the order they are bound, select by cpu % n
+        sock_filter code[] = {
+            { BPF_LD | BPF_W | BPF_ABS, 0, 0, static_cast<__u32>(SKF_AD_OFF + SKF_AD_CPU) },
+            { BPF_ALU | BPF_MOD | BPF_K, 0, 0, static_cast<__u32>(n) },
+            { BPF_RET | BPF_A, 0, 0, 0 },
+        };
+        sock_fprog prog = { sizeof(code) / sizeof(code[0]), code };
+        if (::setsockopt(impl->listeners_[0].native_handle(), SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog, sizeof(prog)) != 0)
+            throw boost::system::system_error(errno, boost::system::system_category());
+#else
+        throw boost::system::system_error(make_error_code(boost::system::errc::operation_not_supported));
+#endif
+    }
+    impl->bound_.store(true, std::memory_order_relaxed);
+    for (std::size_t i = 0; i < n; ++i)
+    {
+        impl->listeners_[i].listen();
+        for (std::size_t k = 0; k < impl->pending_; ++k)
+            accept(i);
+    }
 }
 
 void acceptor::unbind()
 {
-    auto& acceptor_ = static_cast<acceptor_impl*>(this)->acceptor_;
-    acceptor_.cancel();
+    auto impl = static_cast<acceptor_impl*>(this);
+    impl->bound_.store(false, std::memory_order_relaxed);
+    for (auto& acceptor_ : impl->listeners_)
+        acceptor_.cancel();
 }
 
-void acceptor::accept()
+void acceptor::accept(std::size_t listener, unsigned backoff)
 {
-    auto& acceptor_ = static_cast<acceptor_impl*>(this)->acceptor_;
-    acceptor_.async_accept([self = shared_from_this()]
-    (const boost::system::error_code& ec, socket socket)
+    auto impl = static_cast<acceptor_impl*>(this);
+    context_ptr ctx = impl->pick(listener);
+    // accepted socket runs its handlers in its own strand, @see session::socket()
+    socket::executor_type ex(boost::asio::make_strand(*ctx));
+    impl->listeners_[listener].async_accept(std::move(ex),
+    [self = shared_from_this(), listener, backoff, ctx = std::move(ctx)](const boost::system::error_code& ec, socket socket) mutable
     {
-        if (ec)
+        auto impl = static_cast<acceptor_impl*>(self.get());
+        if (ec == boost::asio::error::operation_aborted)
+        {
+            // unbind()
+        }
+        else if (ec)
         {
-            throw boost::system::system_error(ec);
+            int ms = impl->retry(ec, backoff);
+            if (ms < 0) throw boost::system::system_error(ec);
+            if (ms == 0) return self->accept(listener, backoff);
+            auto timer = std::make_shared<boost::asio::steady_timer>(*impl->pool_[listener], std::chrono::milliseconds(ms));
+            timer->async_wait([self = std::move(self), listener, backoff, timer](const boost::system::error_code&)
+            {
+                auto impl = static_cast<acceptor_impl*>(self.get());
+                if (impl->bound_.load(std::memory_order_relaxed)) self->accept(listener, backoff);
+            });
         }
         else
         {
-            self->accept();
-            auto session = self->manager_->create(self);
+            impl->accepted_.fetch_add(1, std::memory_order_relaxed);
+            self->accept(listener);
+            if (context_ptr other = impl->pick(socket); other && other != ctx)
+            {
+                // move the descriptor to the strand of another context, keep it here if not supported
+                boost::system::error_code ignored;
+                auto protocol = socket.local_endpoint(ignored).protocol();
+                minapp::socket moved(boost::asio::make_strand(*other));
+                auto fd = socket.release(ignored);
+                if (!ignored) moved.assign(protocol, fd, ignored);
+                if (!ignored) socket = std::move(moved), ctx = other;
+                else if (!socket.is_open()) socket.assign(protocol, fd, ignored);
+            }
+            auto session = self->manager_->create(self, std::move(ctx));
             session->socket_ = std::move(socket);
             session->handler_ = self->handler_;
-            session->connect(ec, nullptr);
+            boost::asio::dispatch(session->socket_.get_executor(), [session]
+            {
+                session->connect({}, nullptr);
+            });
         }
     });
 }
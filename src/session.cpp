@@ -1,12 +1,3 @@
-#include <boost/version.hpp>
-#if BOOST_VERSION >= 107000
-#  ifndef BOOST_ASIO_NO_DYNAMIC_BUFFER_V1
-#    define BOOST_ASIO_NO_DYNAMIC_BUFFER_V1
-#  endif
-#else
-#  undef BOOST_ASIO_NO_DYNAMIC_BUFFER_V1
-#endif
-
 #include <minapp/handler.hpp>
 #include <minapp/session.hpp>
 #include <minapp/service.hpp>
@@ -14,7 +5,41 @@
 #include <minapp/spinlock.hpp>
 
 #include <mutex>
+#include <optional>
+#include <thread>
+#include <unordered_map>
+#include <climits>
+#include <cstring>
+
+#if defined(__AVX2__)
+#  define MINAPP_HAS_AVX2 1
+#endif
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#  define MINAPP_HAS_SSE2 1
+#endif
+#if defined(__linux__)
+#  define MINAPP_HAS_SPLICE 1
+#  include <fcntl.h>
+#  include <unistd.h>
+#  include <netinet/in.h>
+#  include <sys/socket.h>
+#  include <sys/sendfile.h>
+#  include <linux/errqueue.h>
+#  if defined(MSG_ZEROCOPY) && defined(SO_ZEROCOPY)
+#    define MINAPP_HAS_ZEROCOPY 1
+#  endif
+#endif
+#if !defined(_WIN32)
+#  define MINAPP_HAS_PREAD 1
+#  include <unistd.h>
+#endif
+#ifdef _MSC_VER
+#  include <intrin.h>
+#elif MINAPP_HAS_AVX2 || MINAPP_HAS_SSE2
+#  include <immintrin.h>
+#endif
 
+#include <boost/version.hpp>
 #if BOOST_VERSION >= 107400
 #include <boost/stl_interfaces/iterator_interface.hpp>
 #else
@@ -22,10 +47,12 @@
 #endif
 #include <boost/range/iterator_range_core.hpp>
 #include <boost/asio/connect.hpp>
+#include <boost/asio/dispatch.hpp>
+#include <boost/asio/post.hpp>
 #include <boost/asio/read.hpp>
-#include <boost/asio/read_until.hpp>
+#include <boost/asio/steady_timer.hpp>
+#include <boost/asio/strand.hpp>
 #include <boost/asio/write.hpp>
-#include <boost/intrusive/set.hpp>
 
 using namespace minapp;
 
@@ -33,171 +60,604 @@ using namespace minapp;
 #undef CALLBACK
 #define CALLBACK(...) [self = shared_from_this(), ## __VA_ARGS__](const boost::system::error_code& ec, std::size_t bytes_transferred)
 
-namespace
+namespace minapp
 {
-#ifndef BOOST_ASIO_NO_DYNAMIC_BUFFER_V1
-
-    struct dynamic_buffer_adaptor
+    /// Hashed timing wheel of the session timeouts of a manager, a slot per tick of a revolution.
+    /// A session is filed once, in the slot of its earliest deadline at the time. I/O moves the
+    /// deadlines by a store only, a session found early when its slot comes round is filed again
+    /// for the deadline moved to. The timer ticks only while sessions are filed.
+    class timing_wheel
     {
-        triple_buffer& impl;
-        const std::size_t maximum;
+    public:
+        static constexpr std::chrono::milliseconds resolution{100};
+        static constexpr std::size_t slots = 512;
+
+        /// Ticks for @p timeout, rounded up.
+        static std::uint32_t ticks(std::chrono::milliseconds timeout)
+        {
+            if (timeout.count() <= 0) return 0;
+            auto n = (timeout.count() + resolution.count() - 1) / resolution.count();
+            return static_cast<std::uint32_t>((std::min)(n, static_cast<decltype(n)>(UINT32_MAX)));
+        }
+
+        /// The current tick, which has partially passed, so a deadline of t ticks is now() + t + 1.
+        std::uint64_t now() const
+        {
+            return tick_.load(std::memory_order_relaxed);
+        }
 
-        using const_buffers_type = triple_buffer::const_buffers_type;
-        using mutable_buffers_type = triple_buffer::mutable_buffers_type;
+        /// Catch up with the clock, which the timer stops following without filed sessions.
+        std::uint64_t advance()
+        {
+            const std::uint64_t t = clock();
+            std::uint64_t current = tick_.load();
+            while (current < t && !tick_.compare_exchange_weak(current, t));
+            return (std::max)(current, t);
+        }
 
-        dynamic_buffer_adaptor(const dynamic_buffer_adaptor&) = delete;
-        dynamic_buffer_adaptor(dynamic_buffer_adaptor&&) = default;
+        void arm(const session_ptr& s)
+        {
+            if (s->wheel_filed_.exchange(true)) return;
+            filed_.fetch_add(1);
+            file(s, s->deadline());
+            if (!running_.exchange(true)) start(*s);
+        }
 
-        const_buffers_type data() const
+        /// Drop @p s found in a slot, filed again if a timeout is set meanwhile.
+        void release(const session_ptr& s)
         {
-            return impl.internal_input_buffer();
+            s->wheel_filed_.store(false);
+            filed_.fetch_sub(1);
+            if (s->status() < status::closed && s->deadline() != 0) arm(s);
         }
 
-        std::size_t size() const
+        void file(const session_ptr& s, std::uint64_t deadline)
         {
-            return impl.internal_input_buffer().size();
+            // a slot swept for the tick already is filled for the next revolution, so file no
+            // earlier than the tick to sweep next, checked under the lock the sweep takes
+            for (;;)
+            {
+                const std::uint64_t t = (std::max)(deadline, swept_.load() + 1);
+                slot& sl = slots_[t % slots];
+                std::lock_guard<spinlock> guard(sl.guard);
+                if (t > swept_.load()) return sl.sessions.push_back(s);
+            }
         }
 
-        std::size_t max_size() const
+    private:
+        struct slot
         {
-            return (std::min)(impl.max_size() - impl.external_input_buffer().size(), maximum);
+            spinlock guard;
+            std::vector<std::weak_ptr<session>> sessions;
+        };
+
+        const std::chrono::steady_clock::time_point epoch_ = std::chrono::steady_clock::now();
+        std::atomic<std::uint64_t> tick_{0};
+        std::atomic<std::uint64_t> swept_{0};
+        std::atomic<std::size_t> filed_{0};
+        std::atomic<bool> running_{false};
+        slot slots_[slots];
+        std::vector<std::weak_ptr<session>> sweeping_;
+        std::weak_ptr<session_manager> manager_;
+        context_ptr context_;
+        std::optional<boost::asio::steady_timer> timer_;
+
+        std::uint64_t clock() const
+        {
+            return static_cast<std::uint64_t>((std::chrono::steady_clock::now() - epoch_) / resolution);
         }
 
-        std::size_t capacity() const
+        // the caller won running_, the timer and the members of it are not shared then
+        void start(session& s)
         {
-            // Note that capacity may be greater than max_size
-            return impl.capacity() - impl.external_input_buffer().size();
+            if (!timer_)
+            {
+                manager_ = s.service()->manager();
+                context_ = s.service()->context();
+                timer_.emplace(*context_);
+            }
+            wait();
         }
 
-        mutable_buffers_type prepare(std::size_t n)
+        void wait()
         {
-            // Note that size may be greater than max_size
-            if (size() > max_size() || max_size() - size() < n)
-                throw std::length_error("dynamic_buffer too long");
-            return impl.prepare_output_buffer(n);
+            timer_->expires_at(epoch_ + resolution * static_cast<std::int64_t>(now() + 1));
+            timer_->async_wait([this, manager = manager_](const boost::system::error_code& ec)
+            {
+                // the wheel is a member of the manager
+                auto alive = manager.lock();
+                if (!alive || ec == boost::asio::error::operation_aborted) return;
+                sweep();
+                if (filed_.load() == 0)
+                {
+                    running_.store(false);
+                    if (filed_.load() == 0 || running_.exchange(true)) return;
+                }
+                wait();
+            });
         }
 
-        void commit(std::size_t n)
+        void sweep()
         {
-            impl.commit_to_internal_input(n);
+            const std::uint64_t now = advance();
+            std::uint64_t t = swept_.load() + 1;
+            // one revolution visits every slot after the timer fell far behind
+            if (now >= slots && t + slots <= now) t = now - slots + 1;
+            for (; t <= now; ++t)
+            {
+                slot& sl = slots_[t % slots];
+                {
+                    std::lock_guard<spinlock> guard(sl.guard);
+                    sweeping_.swap(sl.sessions);
+                    swept_.store(t);
+                }
+                for (auto& weak : sweeping_) visit(weak.lock(), now);
+                sweeping_.clear();
+            }
         }
 
-        void consume(std::size_t n); // [async_]read_util() do not need consume, and it's requirement
-                                     // of DynamicBuffer is not compatible with triple_buffer.
-                                     // Declare it to meet the DynamicBuffer requirements and no define
-                                     // it to catch error if it is called anywhere.
+        void visit(session_ptr s, std::uint64_t now)
+        {
+            if (!s) return (void)filed_.fetch_sub(1);
+            const std::uint64_t deadline = s->status() < status::closed ? s->deadline() : 0;
+            if (deadline == 0) return release(s);
+            if (deadline > now) return file(s, deadline);
+            // checked again and closed in the strand, serialized with the callbacks of session
+            auto executor = s->socket_.get_executor();
+            boost::asio::post(executor, [s = std::move(s)] { s->expire(); });
+        }
     };
+}
 
+namespace
+{
+    inline unsigned count_trailing_zeros(unsigned x)
+    {
+#ifdef _MSC_VER
+        unsigned long i;
+        _BitScanForward(&i, x);
+        return i;
 #else
+        return __builtin_ctz(x);
+#endif
+    }
 
-    struct dynamic_buffer_adaptor
+    // Position of the first delimiter [d, d + n) in [p, p + size), or size if not found.
+    // Candidates are filtered by matching the first and the last byte of delimiter in
+    // parallel, so a crlf is found by the vector compare alone.
+    std::size_t find_delim(const char* p, std::size_t size, const char* d, std::size_t n)
     {
-        triple_buffer& impl;
-        const std::size_t maximum;
-
-        using const_buffers_type = triple_buffer::const_buffers_type;
-        using mutable_buffers_type = triple_buffer::mutable_buffers_type;
+        if (size < n) return size;
 
-        mutable_buffers_type data(std::size_t pos, std::size_t n)
+        if (n == 1)
         {
-            return boost::asio::buffer(boost::asio::buffer(
-                    impl.internal_input_buffer().data(), size()) + pos, n);
+            auto q = static_cast<const char*>(std::memchr(p, d[0], size));
+            return q ? q - p : size;
         }
 
-        const_buffers_type data(std::size_t pos, std::size_t n) const
+        const std::size_t last = size - n + 1;
+        std::size_t i = 0;
+
+#if MINAPP_HAS_AVX2
+        const __m256i first32 = _mm256_set1_epi8(d[0]);
+        const __m256i back32 = _mm256_set1_epi8(d[n - 1]);
+        for (; i + 32 <= last; i += 32)
+        {
+            __m256i a = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p + i));
+            __m256i b = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p + i + n - 1));
+            auto mask = static_cast<unsigned>(_mm256_movemask_epi8(
+                    _mm256_and_si256(_mm256_cmpeq_epi8(a, first32), _mm256_cmpeq_epi8(b, back32))));
+            for (; mask != 0; mask &= mask - 1)
+            {
+                std::size_t k = i + count_trailing_zeros(mask);
+                if (n == 2 || std::memcmp(p + k + 1, d + 1, n - 2) == 0) return k;
+            }
+        }
+#endif
+#if MINAPP_HAS_SSE2
+        const __m128i first16 = _mm_set1_epi8(d[0]);
+        const __m128i back16 = _mm_set1_epi8(d[n - 1]);
+        for (; i + 16 <= last; i += 16)
         {
-            return boost::asio::buffer(boost::asio::buffer(
-                    impl.internal_input_buffer().data(), size()) + pos, n);
+            __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + i));
+            __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + i + n - 1));
+            auto mask = static_cast<unsigned>(_mm_movemask_epi8(
+                    _mm_and_si128(_mm_cmpeq_epi8(a, first16), _mm_cmpeq_epi8(b, back16))));
+            for (; mask != 0; mask &= mask - 1)
+            {
+                std::size_t k = i + count_trailing_zeros(mask);
+                if (n == 2 || std::memcmp(p + k + 1, d + 1, n - 2) == 0) return k;
+            }
+        }
+#endif
+        for (; i < last; ++i)
+        {
+            auto q = static_cast<const char*>(std::memchr(p + i, d[0], last - i));
+            if (!q) break;
+            i = q - p;
+            if (p[i + n - 1] == d[n - 1] && std::memcmp(p + i + 1, d + 1, n - 2) == 0) return i;
         }
+        return size;
+    }
+
+    const std::size_t size_msb = std::size_t(-1) - (std::size_t(-1) >> 1u);
+
+    const std::string crlf = { '\r', '\n' };
+
+    // same as the number of buffers asio passes to a single gather write
+#if defined(BOOST_ASIO_WINDOWS) || defined(__CYGWIN__)
+    const std::size_t max_gather_buffers = 64;
+#elif defined(IOV_MAX)
+    const std::size_t max_gather_buffers = IOV_MAX < 64 ? IOV_MAX : 64;
+#else
+    const std::size_t max_gather_buffers = 16;
+#endif
+
+    const std::size_t coalesce_chunk_size = 65536;
+
+    std::atomic_ulong id = 1;
 
-        std::size_t size() const
+
+    struct session_impl : session
+    {
+        session_impl(service_ptr service, context_ptr ctx);
+        ~session_impl();
+    };
+
+    /// Sessions by id in shards, each a chained hash table whose nodes are immutable but the link.
+    /// Writers of a shard take its spinlock, readers take no lock but join one of two reader phases.
+    /// Unlinked nodes and outgrown tables are retired in the current phase, and freed once the
+    /// readers of the phase before, which may still see them, are drained. Writers and the last
+    /// reader leaving a phase advance it, so retirees do not pile up under read-mostly traffic.
+    class session_registry
+    {
+        struct node
+        {
+            virtual ~node() = default;
+        };
+
+        struct entry : node
+        {
+            const unsigned long id;
+            const std::weak_ptr<session> weak;
+            std::atomic<entry*> next;
+
+            entry(unsigned long id, std::weak_ptr<session> weak, entry* next)
+                : id(id), weak(std::move(weak)), next(next) {}
+        };
+
+        struct table : node
+        {
+            const std::size_t mask;
+            const std::unique_ptr<std::atomic<entry*>[]> buckets;
+
+            explicit table(std::size_t n) : mask(n - 1), buckets(new std::atomic<entry*>[n])
+            {
+                for (std::size_t i = 0; i < n; ++i) buckets[i].store(nullptr, std::memory_order_relaxed);
+            }
+
+            std::atomic<entry*>& bucket(unsigned long id) const
+            {
+                return buckets[(id / shards) & mask];
+            }
+        };
+
+        struct alignas(64) shard
+        {
+            std::atomic<table*> buckets{nullptr};
+            std::atomic<unsigned> phase{0};
+            std::atomic<unsigned> readers[2]{};
+            std::atomic<bool> pending{false};
+            spinlock guard;
+            std::size_t size = 0;
+            std::vector<std::unique_ptr<node>> retired[2];
+
+            ~shard()
+            {
+                if (table* t = buckets.load(std::memory_order_relaxed))
+                {
+                    for (std::size_t i = 0; i <= t->mask; ++i)
+                        for (entry* e = t->buckets[i].load(std::memory_order_relaxed); e;)
+                            delete std::exchange(e, e->next.load(std::memory_order_relaxed));
+                    delete t;
+                }
+            }
+
+            // called with guard held
+            bool advance()
+            {
+                unsigned p = phase.load(std::memory_order_relaxed);
+                if (readers[~p & 1].load() != 0) return false;
+                // nobody sees nodes of the phase before, its readers are gone
+                retired[~p & 1].clear();
+                phase.store(p + 1);
+                return true;
+            }
+
+            // called with guard held
+            void retire(std::unique_ptr<node> r)
+            {
+                retired[phase.load(std::memory_order_relaxed) & 1].push_back(std::move(r));
+                pending.store(true, std::memory_order_relaxed);
+                advance();
+            }
+
+            unsigned enter()
+            {
+                unsigned p = phase.load() & 1;
+                readers[p].fetch_add(1);
+                return p;
+            }
+
+            void leave(unsigned p)
+            {
+                if (readers[p].fetch_sub(1) != 1 || !pending.load(std::memory_order_relaxed)) return;
+                // the last reader of a phase frees what writers could not, twice empties both lists
+                if (!guard.try_lock()) return;
+                for (int i = 0; i < 2 && advance(); ++i) {}
+                pending.store(!retired[0].empty() || !retired[1].empty(), std::memory_order_relaxed);
+                guard.unlock();
+            }
+        };
+
+        static constexpr unsigned long shards = 64;
+        shard shards_[shards];
+
+        shard& of(unsigned long id)
         {
-            return (std::min)(impl.size() - impl.external_input_buffer().size(), max_size());
+            return shards_[id % shards];
         }
 
-        std::size_t max_size() const
+    public:
+        void insert(const session_ptr& s)
         {
-            return (std::min)(impl.max_size() - impl.external_input_buffer().size(), maximum);
+            shard& sh = of(s->id());
+            std::lock_guard<spinlock> guard(sh.guard);
+            table* t = sh.buckets.load(std::memory_order_relaxed);
+            if (t == nullptr || sh.size > t->mask)
+            {
+                // copies chains into a table of twice the buckets, the old ones are being read
+                auto grown = std::make_unique<table>(t ? (t->mask + 1) * 2 : 16);
+                if (t) for (std::size_t i = 0; i <= t->mask; ++i)
+                {
+                    for (entry* e = t->buckets[i].load(std::memory_order_relaxed); e; e = e->next.load(std::memory_order_relaxed))
+                    {
+                        auto& b = grown->bucket(e->id);
+                        b.store(new entry(e->id, e->weak, b.load(std::memory_order_relaxed)), std::memory_order_relaxed);
+                    }
+                }
+                sh.buckets.store(grown.release());
+                if (t)
+                {
+                    for (std::size_t i = 0; i <= t->mask; ++i)
+                        for (entry* e = t->buckets[i].load(std::memory_order_relaxed); e;)
+                            sh.retire(std::unique_ptr<entry>(std::exchange(e, e->next.load(std::memory_order_relaxed))));
+                    sh.retire(std::unique_ptr<table>(t));
+                }
+                t = sh.buckets.load(std::memory_order_relaxed);
+            }
+            auto& b = t->bucket(s->id());
+            b.store(new entry(s->id(), s, b.load(std::memory_order_relaxed)));
+            ++sh.size;
         }
 
-        std::size_t capacity() const
+        void erase(unsigned long id)
         {
-            return (std::min)(impl.capacity() - impl.external_input_buffer().size(), max_size());
+            shard& sh = of(id);
+            std::lock_guard<spinlock> guard(sh.guard);
+            table* t = sh.buckets.load(std::memory_order_relaxed);
+            if (t == nullptr) return;
+            std::atomic<entry*>* link = &t->bucket(id);
+            for (entry* e = link->load(std::memory_order_relaxed); e; e = link->load(std::memory_order_relaxed))
+            {
+                if (e->id == id)
+                {
+                    link->store(e->next.load(std::memory_order_relaxed));
+                    --sh.size;
+                    sh.retire(std::unique_ptr<entry>(e));
+                    return;
+                }
+                link = &e->next;
+            }
         }
 
-        void grow(std::size_t n)
+        /// Calls bool f(const std::weak_ptr<session>&) of entries of shard @p i until it returns false.
+        template<typename F>
+        bool scan(std::size_t i, F&& f)
         {
-            if (max_size() - size() < n)
-                throw std::length_error("dynamic_buffer too long");
-            impl.grow_output_buffer(n);
+            shard& sh = shards_[i];
+            unsigned p = sh.enter();
+            bool more = true;
+            if (table* t = sh.buckets.load())
+            {
+                for (std::size_t b = 0; more && b <= t->mask; ++b)
+                    for (entry* e = t->buckets[b].load(); more && e; e = e->next.load())
+                        more = f(e->weak);
+            }
+            sh.leave(p);
+            return more;
         }
 
-        void shrink(std::size_t n)
+        session_ptr find(unsigned long id)
         {
-            impl.shrink_output_buffer(n);
+            session_ptr s;
+            shard& sh = of(id);
+            unsigned p = sh.enter();
+            if (table* t = sh.buckets.load())
+            {
+                for (entry* e = t->bucket(id).load(); e; e = e->next.load())
+                    if (e->id == id) { s = e->weak.lock(); break; }
+            }
+            sh.leave(p);
+            return s;
         }
 
-        void consume(std::size_t n); // [async_]read_util() do not need consume, and it's requirement
-                                     // of DynamicBuffer is not compatible with triple_buffer.
-                                     // Declare it to meet the DynamicBuffer requirements and no define
-                                     // it to catch error if it is called anywhere.
+        static constexpr std::size_t size() { return shards; }
     };
 
-#endif
+    struct manager_impl : session_manager
+    {
+        session_registry sessions;
+        timing_wheel wheel;
+
+        // Sessions per context, the first contexts claim slots on first use and never release
+        // them, found without lock. Contexts beyond the slots are counted in a map under lock.
+        struct load
+        {
+            std::atomic<const context*> ctx{nullptr};
+            std::atomic<std::size_t> count{0};
+        };
+        static constexpr std::size_t max_loads = 64;
+        load loads[max_loads];
+        spinlock overflow_guard;
+        std::unordered_map<const context*, std::unique_ptr<std::atomic<std::size_t>>> overflow;
+
+        std::atomic<std::size_t>* count(const context* ctx)
+        {
+            for (auto& l : loads)
+            {
+                const context* c = l.ctx.load(std::memory_order_acquire);
+                if (c == nullptr && l.ctx.compare_exchange_strong(c, ctx, std::memory_order_acq_rel))
+                    return &l.count;
+                if (c == ctx) return &l.count;
+            }
+            std::lock_guard<spinlock> guard(overflow_guard);
+            auto& count = overflow[ctx];
+            if (!count) count = std::make_unique<std::atomic<std::size_t>>(0);
+            return count.get();
+        }
+    };
+}
+
+/// Bytes relayed from a session to its peer. Spliced bytes wait in the pipe and are queued to
+/// peer as regions without data, which the write engine of peer splices out in order.
+struct session::relay_state
+{
+    static constexpr std::size_t chunk_size = 65536;
+    static constexpr std::size_t pooled_chunks = 8;
 
-    static_assert(boost::asio::is_dynamic_buffer<dynamic_buffer_adaptor>::value,
-                  "dynamic_buffer_adaptor should model the boost::asio::DynamicBuffer concept");
+    /// Queued to peer for bytes in pipe. Released when written or dropped, making room for source.
+    struct pipe_region
+    {
+        const std::shared_ptr<relay_state> relay;
+        const std::size_t size;
 
+        pipe_region(std::shared_ptr<relay_state> relay, std::size_t size) : relay(std::move(relay)), size(size) {}
+        pipe_region(const pipe_region&) = delete;
+        ~pipe_region() { relay->drained(size); }
+    };
 
-    const std::size_t size_msb = std::size_t(-1) - (std::size_t(-1) >> 1u);
+    /// Storage of bytes read into a chunk of pool, the chunk goes back when written.
+    struct pooled_chunk
+    {
+        const std::shared_ptr<relay_state> relay;
+        std::unique_ptr<char[]> data;
 
-    const std::string crlf = { '\r', '\n' };
+        pooled_chunk(std::shared_ptr<relay_state> relay, std::unique_ptr<char[]> data)
+            : relay(std::move(relay)), data(std::move(data)) {}
+        pooled_chunk(const pooled_chunk&) = delete;
+        ~pooled_chunk() { relay->give(std::move(data)); }
+    };
 
-    std::atomic_ulong id = 1;
+    const std::weak_ptr<session> peer;
+    int pipe[2] = { -1, -1 };
+    std::size_t capacity = 0;
+    bool spliced = false;
+    std::atomic<std::size_t> in_pipe{0};
+    std::atomic<bool> full{false};
+    session_ptr waiting;    // source waiting for room, owned by whoever resets full
 
+    spinlock guard;
+    std::vector<std::unique_ptr<char[]>> chunks;
 
-    struct session_impl : session, boost::intrusive::set_base_hook<boost::intrusive::link_mode<boost::intrusive::safe_link>>
+    explicit relay_state(std::weak_ptr<session> peer) : peer(std::move(peer))
     {
-        explicit session_impl(service_ptr service);
-        ~session_impl();
-    };
+#if MINAPP_HAS_SPLICE
+        if (::pipe2(pipe, O_NONBLOCK | O_CLOEXEC) == 0)
+        {
+            ::fcntl(pipe[1], F_SETPIPE_SZ, 1 << 20);    // best effort, limited by fs.pipe-max-size
+            int sz = ::fcntl(pipe[1], F_GETPIPE_SZ);
+            capacity = sz > 0 ? sz : 65536;
+        }
+#endif
+    }
 
-    struct session_id
+    ~relay_state()
     {
-        using type = unsigned long;
-        type operator()(const session& s) const noexcept { return s.id(); }
-    };
+        close_pipe();
+    }
 
-    struct manager_impl : session_manager
+    void close_pipe()
     {
-        typedef boost::intrusive::set<session_impl,
-                boost::intrusive::constant_time_size<false>,
-                boost::intrusive::key_of_value<session_id>> session_set;
+#if MINAPP_HAS_SPLICE
+        for (int& fd : pipe)
+            if (fd >= 0) ::close(std::exchange(fd, -1));
+#endif
+    }
 
-        spinlock guard;
-        session_set sessions;
-    };
-}
+    void drained(std::size_t n)
+    {
+        in_pipe.fetch_sub(n);
+        if (full.exchange(false))
+        {
+            session_ptr source = std::move(waiting);
+            auto executor = source->socket_.get_executor();
+            boost::asio::post(executor, [self = std::move(source)]
+            {
+                self->read();
+            });
+        }
+    }
+
+    std::unique_ptr<char[]> take()
+    {
+        {
+            std::lock_guard<spinlock> _(guard);
+            if (!chunks.empty())
+            {
+                auto chunk = std::move(chunks.back());
+                chunks.pop_back();
+                return chunk;
+            }
+        }
+        return std::unique_ptr<char[]>(new char[chunk_size]);
+    }
+
+    void give(std::unique_ptr<char[]> chunk)
+    {
+        std::lock_guard<spinlock> _(guard);
+        if (chunks.size() < pooled_chunks) chunks.push_back(std::move(chunk));
+    }
+};
 
-session_impl::session_impl(service_ptr service) : session(std::move(service))
+session_impl::session_impl(service_ptr service, context_ptr ctx) : session(std::move(service), std::move(ctx))
 {
     auto impl = static_cast<manager_impl*>(this->service()->manager().get());
-    std::lock_guard<spinlock> guard(impl->guard);
-    impl->sessions.insert(*this);
+    impl->count(&execution_context())->fetch_add(1, std::memory_order_relaxed);
 }
 
 session_impl::~session_impl()
 {
     auto impl = static_cast<manager_impl*>(this->service()->manager().get());
-    std::lock_guard<spinlock> guard(impl->guard);
-    impl->sessions.erase(impl->sessions.iterator_to(*this));
+    impl->sessions.erase(id());
+    impl->count(&execution_context())->fetch_sub(1, std::memory_order_relaxed);
 }
 
-session::session(service_ptr service)
+session::session(service_ptr service, context_ptr ctx)
     : id_(::id.fetch_add(1, std::memory_order_relaxed)),
-      service_(std::move(service)), socket_(*service_->context()),
+      service_(std::move(service)), context_(ctx ? std::move(ctx) : service_->context()),
+      socket_(boost::asio::make_strand(*context_)),
       protocol_(protocol::any), protocol_options_{},
-      status_(status::connecting), read_buffer_size_(65536)
+      status_(status::connecting), read_buffer_size_(65536), read_ahead_size_(0), read_budget_(64),
+      delim_scanned_(0), cork_(false),
+      coalesce_threshold_(512), bytes_coalesced_(0), bytes_in_place_(0), bytes_zerocopy_(0),
+      write_low_watermark_(0), write_high_watermark_(0), write_blocked_(false), watermark_pending_(false),
+      read_paused_(false), read_parked_(false),
+      zerocopy_threshold_(0), zerocopy_next_(0), zerocopy_enabled_(false), zerocopy_armed_(false),
+      wheel_(&static_cast<manager_impl*>(service_->manager().get())->wheel),
+      idle_timeout_(0), read_timeout_(0), write_timeout_(0),
+      idle_deadline_(0), read_deadline_(0), write_deadline_(0), wheel_filed_(false),
+      timers_pending_(0)
 {
 
 }
@@ -222,6 +682,26 @@ void session::read_buffer_size(std::size_t sz)
     read_buffer_size_ = sz;
 }
 
+std::size_t session::read_ahead_size() const
+{
+    return read_ahead_size_;
+}
+
+void session::read_ahead_size(std::size_t sz)
+{
+    read_ahead_size_ = sz;
+}
+
+std::size_t session::read_budget() const
+{
+    return read_budget_;
+}
+
+void session::read_budget(std::size_t frames)
+{
+    read_budget_ = (std::max)(frames, std::size_t(1));
+}
+
 const std::string& session::delimiter() const
 {
     return delimiter_;
@@ -231,11 +711,13 @@ void session::delimiter(char delim)
 {
     delimiter_.clear();
     delimiter_.push_back(delim);
+    delim_scanned_ = 0;
 }
 
 void session::delimiter(std::string delim)
 {
     delimiter_ = std::move(delim);
+    delim_scanned_ = 0;
 }
 
 enum protocol session::protocol() const
@@ -252,6 +734,7 @@ void session::protocol(enum protocol protocol, enum protocol_options options)
 {
     protocol_ = protocol;
     protocol_options_ = options;
+    delim_scanned_ = 0;
 }
 
 void session::protocol(enum protocol protocol, std::size_t bufsz, enum protocol_options options)
@@ -309,19 +792,57 @@ void session::close(bool immediately)
         boost::system::error_code ignored;
         socket_.shutdown(socket::shutdown_both, ignored);
         socket_.close(ignored);
+
+        session_ptr parked;
+        if (read_parked_.exchange(false)) parked = std::move(parked_);
+
+        {
+            std::lock_guard<spinlock> guard(throttle_guard_);
+            if (write_blocked_.exchange(false, std::memory_order_relaxed))
+                if (auto reader = throttled_.lock()) reader->resume_read();
+        }
+
+        cancel_timers();
         handler()->close(this);
     }
     else
     {
         boost::system::error_code ignored;
         socket_.shutdown(socket::shutdown_receive, ignored);
-        write();
+        flush();
+    }
+}
+
+session::timer_list::iterator session::acquire_timer()
+{
+    // called in the strand, the timers of the session are reused rather than allocated each time
+    if (idle_timers_.empty()) idle_timers_.emplace_back(socket_.get_executor());
+    timers_.splice(timers_.end(), idle_timers_, idle_timers_.begin());
+    return std::prev(timers_.end());
+}
+
+void session::release_timer(timer_list::iterator timer)
+{
+    idle_timers_.splice(idle_timers_.end(), timers_, timer);
+    timers_pending_.fetch_sub(1);
+}
+
+void session::cancel_timers()
+{
+    // none pending in the destructor, each holds a reference
+    if (timers_pending_.load() == 0) return;
+    if (auto self = weak_from_this().lock())
+    {
+        boost::asio::dispatch(socket_.get_executor(), [self = std::move(self)]
+        {
+            for (auto& timer : self->timers_) timer.cancel();
+        });
     }
 }
 
 context& session::execution_context() const
 {
-    return *service_->context();
+    return *context_;
 }
 
 bool session::check(const boost::system::error_code& ec)
@@ -333,9 +854,98 @@ bool session::check(const boost::system::error_code& ec)
         close(false);
         return false;
     }
+    touch(true, false);
     return true;
 }
 
+std::chrono::milliseconds session::idle_timeout() const
+{
+    return timing_wheel::resolution * idle_timeout_.load(std::memory_order_relaxed);
+}
+
+void session::idle_timeout(std::chrono::milliseconds timeout)
+{
+    this->timeout(idle_timeout_, &idle_deadline_, timeout);
+}
+
+std::chrono::milliseconds session::read_timeout() const
+{
+    return timing_wheel::resolution * read_timeout_.load(std::memory_order_relaxed);
+}
+
+void session::read_timeout(std::chrono::milliseconds timeout)
+{
+    this->timeout(read_timeout_, &read_deadline_, timeout);
+}
+
+std::chrono::milliseconds session::write_timeout() const
+{
+    return timing_wheel::resolution * write_timeout_.load(std::memory_order_relaxed);
+}
+
+void session::write_timeout(std::chrono::milliseconds timeout)
+{
+    // the deadline runs from the next write started
+    this->timeout(write_timeout_, nullptr, timeout);
+}
+
+void session::timeout(std::atomic<std::uint32_t>& timeout, std::atomic<std::uint64_t>* deadline,
+                      std::chrono::milliseconds value)
+{
+    const std::uint32_t ticks = timing_wheel::ticks(value);
+    if (deadline) deadline->store(ticks ? wheel_->advance() + ticks + 1 : 0);
+    timeout.store(ticks);
+    if (ticks) wheel_->arm(shared_from_this());
+}
+
+void session::touch(bool read, bool write)
+{
+    // I/O made progress, no syscall nor timer operation here
+    const std::uint32_t idle = idle_timeout_.load(std::memory_order_relaxed);
+    const std::uint32_t r = read ? read_timeout_.load(std::memory_order_relaxed) : 0;
+    const std::uint32_t w = write ? write_timeout_.load(std::memory_order_relaxed) : 0;
+    if ((idle | r | w) == 0) return;
+    const std::uint64_t now = wheel_->now() + 1;
+    if (idle) idle_deadline_.store(now + idle, std::memory_order_relaxed);
+    if (r) read_deadline_.store(now + r, std::memory_order_relaxed);
+    if (w) write_deadline_.store(now + w, std::memory_order_relaxed);
+}
+
+std::uint64_t session::deadline() const
+{
+    // The earliest deadline of the timeouts set, 0 if none. A read paused or no write in flight
+    // is at least a timeout away, the wheel finds it again by then.
+    std::uint64_t earliest = 0;
+    const std::uint64_t now = wheel_->now() + 1;
+    auto next = [&](const std::atomic<std::uint32_t>& timeout, const std::atomic<std::uint64_t>& deadline, bool running)
+    {
+        const std::uint32_t t = timeout.load(std::memory_order_relaxed);
+        if (t == 0) return;
+        const std::uint64_t d = running ? deadline.load(std::memory_order_relaxed) : now + t;
+        if (earliest == 0 || d < earliest) earliest = d;
+    };
+    next(idle_timeout_, idle_deadline_, true);
+    next(read_timeout_, read_deadline_, !read_paused_.load(std::memory_order_relaxed));
+    next(write_timeout_, write_deadline_, write_deadline_.load(std::memory_order_relaxed) != 0);
+    return earliest;
+}
+
+void session::expire()
+{
+    auto self = shared_from_this();
+    if (status_ < status::closed)
+    {
+        const std::uint64_t d = deadline();
+        if (d > wheel_->now()) return wheel_->file(self, d);
+        if (d != 0)
+        {
+            handler()->error(this, make_error_code(boost::asio::error::timed_out));
+            close(true);
+        }
+    }
+    wheel_->release(self);
+}
+
 std::future<session_ptr> session::connect(const endpoint& ep)
 {
     std::promise<session_ptr> promise;
@@ -406,135 +1016,826 @@ bool session::connect(const boost::system::error_code& ec, std::promise<session_
     }
 }
 
+persistent_buffer session::retain(boost::asio::const_buffer frame)
+{
+    return buf_.retain(frame);
+}
+
 void session::write(persistent_buffer_list& list)
 {
     if (status_ >= status::closing) return;
     write_queue_.manage(list);
-    write();
+    queued();
 }
 
-void session::write()
+std::size_t session::coalesce_threshold() const
 {
-    if (status_ >= status::closed) return;
-    auto marker = write_queue_.mark();
-    if (marker <= 0)
-    {
-        if (marker == 0 && status_ == status::closing)
-            close(true);
-        return;
-    }
-
-    boost::asio::async_write(socket_, boost::make_iterator_range(write_queue_.marked()), CALLBACK()
-    {
-        if (ec)
-        {
-            self->handler()->error(self.get(), ec);
-            self->close(true);
-        }
-        else
-        {
-            self->handler()->write(self.get(), self->write_queue_.marked());
-            self->write_queue_.clear_marked();
-            self->write();
-        }
-    });
+    return coalesce_threshold_.load(std::memory_order_relaxed);
 }
 
-void session::read()
+void session::coalesce_threshold(std::size_t sz)
 {
-    auto current = status::connected;
-    if (!status_.compare_exchange_strong(current, status::reading) && current != status::reading)
-        return;
+    coalesce_threshold_.store(sz, std::memory_order_relaxed);
+}
 
-    if(!has_options(protocol_options_, protocol_options::do_not_consume_buffer))
-        buf_.consume_whole_external_input();
-    buf_.mark_current_external_input();
+std::uint64_t session::bytes_coalesced() const
+{
+    return bytes_coalesced_.load(std::memory_order_relaxed);
+}
 
-    switch (protocol_)
-    {
-    case protocol::none:
-        current = status::reading;
-        status_.compare_exchange_strong(current, status::connected);
-        break;
+std::uint64_t session::bytes_in_place() const
+{
+    return bytes_in_place_.load(std::memory_order_relaxed);
+}
 
-    case protocol::any:
-        read_some(read_buffer_size_);
-        break;
+std::size_t session::zerocopy_threshold() const
+{
+    return zerocopy_threshold_.load(std::memory_order_relaxed);
+}
 
-    case protocol::fixed:
-        read_fixed(read_buffer_size_);
-        break;
+void session::zerocopy_threshold(std::size_t sz)
+{
+    zerocopy_threshold_.store(sz, std::memory_order_relaxed);
+}
+
+std::uint64_t session::bytes_zerocopy() const
+{
+    return bytes_zerocopy_.load(std::memory_order_relaxed);
+}
+
+bool session::cork() const
+{
+    return cork_.load(std::memory_order_relaxed);
+}
+
+void session::cork(bool enable)
+{
+    cork_.store(enable, std::memory_order_relaxed);
+    if (!enable) flush();
+}
+
+std::size_t session::write_low_watermark() const
+{
+    return write_low_watermark_.load(std::memory_order_relaxed);
+}
+
+std::size_t session::write_high_watermark() const
+{
+    return write_high_watermark_.load(std::memory_order_relaxed);
+}
+
+void session::write_watermarks(std::size_t low, std::size_t high)
+{
+    write_low_watermark_.store(low, std::memory_order_relaxed);
+    write_high_watermark_.store(high, std::memory_order_relaxed);
+}
+
+std::size_t session::write_queue_size() const
+{
+    return write_queue_.size();
+}
+
+void session::throttle(std::weak_ptr<session> reader)
+{
+    std::lock_guard<spinlock> guard(throttle_guard_);
+    throttled_.swap(reader);
+}
+
+void session::pause_read()
+{
+    read_paused_.store(true);
+}
+
+void session::resume_read()
+{
+    // the read deadline runs again from now
+    if (std::uint32_t t = read_timeout_.load(std::memory_order_relaxed))
+        read_deadline_.store(wheel_->now() + 1 + t, std::memory_order_relaxed);
+    read_paused_.store(false);
+    if (read_parked_.exchange(false))
+    {
+        boost::asio::post(socket_.get_executor(), [self = std::move(parked_)]
+        {
+            self->read();
+        });
+    }
+}
+
+void session::queued()
+{
+    // buffers were queued, raise the high watermark and flush unless corked
+    const std::size_t high = write_high_watermark_.load(std::memory_order_relaxed);
+    if (high > 0 && !write_blocked_.load(std::memory_order_relaxed) &&
+        write_queue_.size() >= high && !watermark_pending_.exchange(true))
+    {
+        boost::asio::post(socket_.get_executor(), [self = shared_from_this()]
+        {
+            self->watermark_pending_.store(false);
+            self->watermark();
+        });
+    }
+
+    if (!cork_.load(std::memory_order_relaxed)) flush();
+}
+
+void session::watermark()
+{
+    bool high;
+
+    {
+        // the reader is paused and resumed under guard, such that close() resumes it finally
+        std::lock_guard<spinlock> guard(throttle_guard_);
+        if (status_ >= status::closed) return;
+
+        const std::size_t size = write_queue_.size();
+        const std::size_t hwm = write_high_watermark_.load(std::memory_order_relaxed);
+        high = !write_blocked_.load(std::memory_order_relaxed);
+        if (high ? (hwm == 0 || size < hwm) : (hwm > 0 && size > write_low_watermark_.load(std::memory_order_relaxed)))
+            return;
+
+        write_blocked_.store(high, std::memory_order_relaxed);
+        if (auto reader = throttled_.lock())
+            high ? reader->pause_read() : reader->resume_read();
+    }
+
+    handler()->watermark(this, high);
+}
+
+void session::flush()
+{
+    if (status_ >= status::closed) return;
+    auto marker = write_queue_.mark();
+    if (marker <= 0)
+    {
+        if (marker == 0 && status_ == status::closing)
+            close(true);
+        return;
+    }
+
+    // The caller wins the only flush in flight. Start it in the strand of socket, inline if
+    // already running there.
+    boost::asio::dispatch(socket_.get_executor(), [self = shared_from_this()]
+    {
+        self->write_marked();
+    });
+}
+
+void session::write_marked()
+{
+    if (std::uint32_t t = write_timeout_.load(std::memory_order_relaxed))
+        write_deadline_.store(wheel_->now() + 1 + t, std::memory_order_relaxed);
+    write_cursor_ = write_queue_.marked().begin();
+    write_batch();
+}
+
+void session::write_batch()
+{
+    // Gather the marked buffers from cursor, copying runs of small ones into one chunk
+    // and passing large ones in place, at most max_gather_buffers for a single syscall.
+    auto& marked = write_queue_.marked();
+    const std::size_t threshold = coalesce_threshold_.load(std::memory_order_relaxed);
+    const std::size_t zerocopy_threshold = zerocopy_threshold_.load(std::memory_order_relaxed);
+    std::size_t copied = 0, passed = 0;
+
+    gather_.clear();
+    coalesce_.clear();
+    if (threshold > 0 && coalesce_.capacity() < coalesce_chunk_size)
+        coalesce_.reserve(coalesce_chunk_size);
+
+    for (; write_cursor_ != marked.end(); ++write_cursor_)
+    {
+        boost::asio::const_buffer b = *write_cursor_;
+        if (b.data() == nullptr && b.size() > 0)
+        {
+            // a region without data in user space, written on its own after the gathered
+            if (gather_.empty()) return write_region();
+            break;
+        }
+
+        if (zerocopy_threshold > 0 && b.size() >= zerocopy_threshold && zerocopy())
+        {
+            if (gather_.empty()) return zerocopy_send(0);
+            break;
+        }
+
+        char* tail = coalesce_.data() + coalesce_.size();
+        if (b.size() < threshold && b.size() <= coalesce_.capacity() - coalesce_.size())
+        {
+            if (!gather_.empty() && static_cast<const char*>(gather_.back().data()) + gather_.back().size() == tail)
+                gather_.back() = boost::asio::buffer(gather_.back().data(), gather_.back().size() + b.size());
+            else if (gather_.size() < max_gather_buffers)
+                gather_.emplace_back(tail, b.size());
+            else
+                break;
+            coalesce_.insert(coalesce_.end(), static_cast<const char*>(b.data()),
+                             static_cast<const char*>(b.data()) + b.size());
+            copied += b.size();
+        }
+        else if (gather_.size() < max_gather_buffers)
+        {
+            gather_.push_back(b);
+            passed += b.size();
+        }
+        else
+        {
+            break;
+        }
+    }
+
+    // Counted for the gather writes only, which the threshold decides for, not for regions or
+    // MSG_ZEROCOPY. Only the strand writes the counters, so a relaxed load and store is enough.
+    bytes_coalesced_.store(bytes_coalesced_.load(std::memory_order_relaxed) + copied, std::memory_order_relaxed);
+    bytes_in_place_.store(bytes_in_place_.load(std::memory_order_relaxed) + passed, std::memory_order_relaxed);
+
+    boost::asio::async_write(socket_, gather_, CALLBACK()
+    {
+        if (ec)
+        {
+            self->handler()->error(self.get(), ec);
+            self->close(true);
+        }
+        else
+        {
+            self->write_next();
+        }
+    });
+}
+
+void session::write_next()
+{
+    touch(false, true);
+    if (write_cursor_ != write_queue_.marked().end())
+        return write_batch();
+
+    // no write in flight until flush() starts the next
+    write_deadline_.store(0, std::memory_order_relaxed);
+    handler()->write(this, write_queue_.marked());
+    write_queue_.clear_marked();
+    zerocopy_reap();
+    if (write_blocked_.load(std::memory_order_relaxed)) watermark();
+    flush();
+}
+
+void session::write_region()
+{
+#if MINAPP_HAS_SPLICE
+    if (object_cast<relay_state::pipe_region>(&write_cursor_->storage()))
+        return splice_region(write_cursor_->size());
+    if (object_cast<file_region>(&write_cursor_->storage()))
+        return sendfile_region(0);
+#elif MINAPP_HAS_PREAD
+    if (object_cast<file_region>(&write_cursor_->storage()))
+        return pread_region(0);
+#endif
+    handler()->error(this, make_error_code(boost::system::errc::operation_not_supported));
+    close(true);
+}
+
+void session::splice_region(std::size_t remaining)
+{
+    touch(false, true);
+#if MINAPP_HAS_SPLICE
+    const int fd = unsafe_object_cast<relay_state::pipe_region>(&write_cursor_->storage())->relay->pipe[0];
+    boost::system::error_code ec;
+    if (!socket_.non_blocking()) socket_.non_blocking(true, ec);
+
+    while (!ec && remaining > 0)
+    {
+        // bytes of region are in pipe before it is queued, so only the socket may block
+        ssize_t n = ::splice(fd, nullptr, socket_.native_handle(), nullptr, remaining,
+                             SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (n > 0)
+        {
+            remaining -= n;
+            touch(false, true);
+        }
+        else if (n < 0 && errno == EAGAIN)
+        {
+            socket_.async_wait(socket::wait_write, [self = shared_from_this(), remaining]
+            (const boost::system::error_code& ec)
+            {
+                if (!ec) return self->splice_region(remaining);
+                self->handler()->error(self.get(), ec);
+                self->close(true);
+            });
+            return;
+        }
+        else
+        {
+            ec = n < 0 ? boost::system::error_code(errno, boost::system::system_category())
+                       : make_error_code(boost::asio::error::broken_pipe);
+        }
+    }
+
+    if (ec)
+    {
+        handler()->error(this, ec);
+        close(true);
+        return;
+    }
+
+    ++write_cursor_;
+    write_next();
+#endif
+}
+
+void session::sendfile_region(std::size_t sent)
+{
+    touch(false, true);
+#if MINAPP_HAS_SPLICE
+    const file_region& r = *unsafe_object_cast<file_region>(&write_cursor_->storage());
+    const std::size_t size = write_cursor_->size();
+    boost::system::error_code ec;
+    if (!socket_.non_blocking()) socket_.non_blocking(true, ec);
+
+    while (!ec && sent < size)
+    {
+        auto offset = static_cast<off_t>(r.offset + sent);
+        ssize_t n = ::sendfile(socket_.native_handle(), r.fd, &offset, (std::min)(size - sent, std::size_t(1) << 30));
+        if (n > 0)
+        {
+            sent += n;
+        }
+        else if (n < 0 && errno == EAGAIN)
+        {
+            socket_.async_wait(socket::wait_write, [self = shared_from_this(), sent]
+            (const boost::system::error_code& ec)
+            {
+                if (!ec) return self->sendfile_region(sent);
+                self->handler()->error(self.get(), ec);
+                self->close(true);
+            });
+            return;
+        }
+        else if (n < 0 && (errno == EINVAL || errno == ENOSYS))
+        {
+            // fd can't be mapped, e.g. a pipe or a file of some FUSE, read it to user space instead
+            return pread_region(sent);
+        }
+        else
+        {
+            // 0 if the file is shorter than the region
+            ec = n < 0 ? boost::system::error_code(errno, boost::system::system_category())
+                       : make_error_code(boost::asio::error::eof);
+        }
+    }
+
+    if (ec)
+    {
+        handler()->error(this, ec);
+        close(true);
+        return;
+    }
+
+    ++write_cursor_;
+    write_next();
+#endif
+}
+
+void session::pread_region(std::size_t sent)
+{
+#if MINAPP_HAS_PREAD
+    touch(false, true);
+    const file_region& r = *unsafe_object_cast<file_region>(&write_cursor_->storage());
+    const std::size_t size = write_cursor_->size();
+    if (sent == size)
+    {
+        ++write_cursor_;
+        return write_next();
+    }
+
+    // the chunk of coalesce is free while a region is written
+    if (coalesce_.capacity() < coalesce_chunk_size) coalesce_.reserve(coalesce_chunk_size);
+    coalesce_.resize(coalesce_.capacity());
+
+    ssize_t n;
+    do n = ::pread(r.fd, coalesce_.data(), (std::min)(size - sent, coalesce_.size()), static_cast<off_t>(r.offset + sent));
+    while (n < 0 && errno == EINTR);
+    if (n <= 0)
+    {
+        handler()->error(this, n < 0 ? boost::system::error_code(errno, boost::system::system_category())
+                                     : make_error_code(boost::asio::error::eof));
+        close(true);
+        return;
+    }
+
+    boost::asio::async_write(socket_, boost::asio::buffer(coalesce_.data(), n), CALLBACK(sent)
+    {
+        if (!ec) return self->pread_region(sent + bytes_transferred);
+        self->handler()->error(self.get(), ec);
+        self->close(true);
+    });
+#endif
+}
+
+bool session::zerocopy()
+{
+#if MINAPP_HAS_ZEROCOPY
+    if (!zerocopy_enabled_)
+    {
+        int one = 1;
+        if (::setsockopt(socket_.native_handle(), SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one)) != 0)
+        {
+            // e.g. not a TCP socket, copy as usual from now on
+            zerocopy_threshold_.store(0, std::memory_order_relaxed);
+            return false;
+        }
+        zerocopy_enabled_ = true;
+    }
+    return true;
+#else
+    return false;
+#endif
+}
+
+void session::zerocopy_send(std::size_t offset)
+{
+    touch(false, true);
+#if MINAPP_HAS_ZEROCOPY
+    persistent_buffer& b = *write_cursor_;
+    while (offset < b.size())
+    {
+        iovec iov = { const_cast<char*>(static_cast<const char*>(b.data())) + offset, b.size() - offset };
+        msghdr msg = {};
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+
+        ssize_t n = ::sendmsg(socket_.native_handle(), &msg, MSG_ZEROCOPY | MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (n >= 0)
+        {
+            // the kernel numbers every successful call, the storage is held until its number completes
+            zerocopy_pending_.emplace_back(zerocopy_next_++, b.storage());
+            bytes_zerocopy_.store(bytes_zerocopy_.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+            offset += n;
+        }
+        else if (errno == EAGAIN || errno == EWOULDBLOCK)
+        {
+            zerocopy_reap();
+            socket_.async_wait(socket::wait_write, [self = shared_from_this(), offset]
+            (const boost::system::error_code& ec)
+            {
+                if (!ec) return self->zerocopy_send(offset);
+                self->handler()->error(self.get(), ec);
+                self->close(true);
+            });
+            return;
+        }
+        else if (errno == ENOBUFS)
+        {
+            // out of option memory for notifications, copy the rest
+            gather_.assign(1, boost::asio::const_buffer(b) + offset);
+            ++write_cursor_;
+            boost::asio::async_write(socket_, gather_, CALLBACK()
+            {
+                if (ec)
+                {
+                    self->handler()->error(self.get(), ec);
+                    self->close(true);
+                }
+                else
+                {
+                    self->write_next();
+                }
+            });
+            return;
+        }
+        else
+        {
+            handler()->error(this, boost::system::error_code(errno, boost::system::system_category()));
+            close(true);
+            return;
+        }
+    }
+
+    ++write_cursor_;
+    write_next();
+#endif
+}
+
+void session::zerocopy_reap()
+{
+#if MINAPP_HAS_ZEROCOPY
+    if (zerocopy_pending_.empty()) return;
+
+    // armed before draining, such that a notification queued after the drain is not missed
+    if (!zerocopy_armed_)
+    {
+        zerocopy_armed_ = true;
+        socket_.async_wait(socket::wait_error, [weak = weak_from_this()](const boost::system::error_code& ec)
+        {
+            auto self = weak.lock();
+            if (!self) return;
+            self->zerocopy_armed_ = false;
+            if (!ec) self->zerocopy_reap();
+        });
+    }
+
+    for (;;)
+    {
+        char control[CMSG_SPACE(sizeof(sock_extended_err)) + CMSG_SPACE(sizeof(sockaddr_in6))];
+        msghdr msg = {};
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        if (::recvmsg(socket_.native_handle(), &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0) break;
 
-    case protocol::delim:
-        read_delim(delimiter_);
-        break;
+        for (cmsghdr* cm = CMSG_FIRSTHDR(&msg); cm != nullptr; cm = CMSG_NXTHDR(&msg, cm))
+        {
+            if (!(cm->cmsg_level == SOL_IP && cm->cmsg_type == IP_RECVERR) &&
+                !(cm->cmsg_level == SOL_IPV6 && cm->cmsg_type == IPV6_RECVERR))
+                continue;
+
+            sock_extended_err ee;
+            std::memcpy(&ee, CMSG_DATA(cm), sizeof(ee));
+            if (ee.ee_origin != SO_EE_ORIGIN_ZEROCOPY || ee.ee_errno != 0) continue;
+
+            // calls numbered [ee_info, ee_data] are completed, wrapping around
+            for (auto& pending : zerocopy_pending_)
+                if (pending.first - ee.ee_info <= ee.ee_data - ee.ee_info)
+                    pending.second = {};
+        }
+    }
 
-    case protocol::delim_zero:
-        read_delim('\0');
-        break;
+    while (!zerocopy_pending_.empty() && !zerocopy_pending_.front().second)
+        zerocopy_pending_.pop_front();
+#endif
+}
 
-    case protocol::delim_cr:
-        read_delim('\r');
-        break;
+void session::read()
+{
+    read_frames();
+    // writes queued by the callbacks of this turn go out in one gather write
+    if (cork_.load(std::memory_order_relaxed)) flush();
+}
 
-    case protocol::delim_lf:
-        read_delim('\n');
-        break;
+void session::read_frames()
+{
+    // Frames already buffered are dispatched in this loop rather than by recursion. Once
+    // read_budget_ frames have been dispatched, yield to other sessions and continue later.
+    for (std::size_t frames = 0; ; ++frames)
+    {
+        auto current = status::connected;
+        if (!status_.compare_exchange_strong(current, status::reading) && current != status::reading)
+            return (void)deliver();
 
-    case protocol::delim_crlf:
-        read_delim(crlf);
-        break;
+        if (read_paused_.load())
+        {
+            // Park with a reference to keep alive. resume_read() re-arms if it sees parked,
+            // otherwise this sees not paused.
+            deliver();
+            parked_ = shared_from_this();
+            read_parked_.store(true);
+            if (read_paused_.load() || !read_parked_.exchange(false)) return;
+            parked_.reset();
+        }
 
-    case protocol::prefix_8:
-        read_prefix(1);
-        break;
+        if (frames >= read_budget_)
+        {
+            deliver();
+            boost::asio::post(socket_.get_executor(), [self = shared_from_this()]
+            {
+                self->read();
+            });
+            return;
+        }
 
-    case protocol::prefix_16:
-        read_prefix(2);
-        break;
+        // frames pending delivery are consumed by deliver()
+        if(frames_.empty() && !has_options(protocol_options_, protocol_options::do_not_consume_buffer))
+            buf_.consume_whole_external_input();
+        buf_.mark_current_external_input();
 
-    case protocol::prefix_32:
-        read_prefix(4);
-        break;
+        if (relay_)
+        {
+            if (deliver()) continue;
+            return relay_read();
+        }
 
-    case protocol::prefix_64:
-        read_prefix(8);
-        break;
+        bool dispatched = false;
 
-    case protocol::prefix_var:
-        read_prefix(size_msb);
-        break;
+        switch (protocol_)
+        {
+        case protocol::none:
+            if ((dispatched = deliver())) break;
+            current = status::reading;
+            status_.compare_exchange_strong(current, status::connected);
+            break;
+
+        case protocol::any:
+            dispatched = read_some(read_buffer_size_);
+            break;
+
+        case protocol::fixed:
+            dispatched = read_fixed(read_buffer_size_);
+            break;
+
+        case protocol::delim:
+            dispatched = read_delim(delimiter_);
+            break;
+
+        case protocol::delim_zero:
+            dispatched = read_delim('\0');
+            break;
+
+        case protocol::delim_cr:
+            dispatched = read_delim('\r');
+            break;
+
+        case protocol::delim_lf:
+            dispatched = read_delim('\n');
+            break;
+
+        case protocol::delim_crlf:
+            dispatched = read_delim(crlf);
+            break;
+
+        case protocol::prefix_8:
+            dispatched = read_prefix(1);
+            break;
+
+        case protocol::prefix_16:
+            dispatched = read_prefix(2);
+            break;
+
+        case protocol::prefix_32:
+            dispatched = read_prefix(4);
+            break;
+
+        case protocol::prefix_64:
+            dispatched = read_prefix(8);
+            break;
+
+        case protocol::prefix_var:
+            dispatched = read_prefix(size_msb);
+            break;
+
+        default:
+            if ((dispatched = deliver())) break;
+            this->check(make_error_code(boost::system::errc::protocol_not_supported));
+        }
 
-    default:
-        this->check(make_error_code(boost::system::errc::protocol_not_supported));
+        if (!dispatched) return;
     }
 }
 
-void session::read_some(std::size_t bufsize)
+void session::relay(session_ptr peer)
+{
+    relay_ = std::make_shared<relay_state>(std::move(peer));
+}
+
+void session::relay_read()
+{
+    auto peer = relay_->peer.lock();
+    if (!peer || peer->status() >= status::closing) return close();
+
+    // bytes read ahead of frames go first
+    auto rest = buf_.internal_input_buffer();
+    if (rest.size() > 0)
+    {
+        peer->write(buf_.retain(rest));
+        buf_.consume_from_internal_input(rest.size());
+    }
+
+#if MINAPP_HAS_SPLICE
+    if (relay_->pipe[1] >= 0) return relay_splice(peer);
+#endif
+    relay_copy();
+}
+
+void session::relay_splice(const session_ptr& peer)
+{
+#if MINAPP_HAS_SPLICE
+    auto& r = *relay_;
+    boost::system::error_code ec;
+    if (!socket_.non_blocking() && (socket_.non_blocking(true, ec), !check(ec))) return;
+
+    // bounded by the capacity of pipe, which the peer drains
+    for (;;)
+    {
+        if (peer->status() >= status::closing) return close();
+
+        const std::size_t used = r.in_pipe.load();
+        ssize_t n = -1;
+        errno = EAGAIN;
+        if (used < r.capacity)
+            n = ::splice(socket_.native_handle(), nullptr, r.pipe[1], nullptr, r.capacity - used,
+                         SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+
+        if (n > 0)
+        {
+            // read without completion handler, so check() does not see it
+            touch(true, false);
+            r.spliced = true;
+            r.in_pipe.fetch_add(n);
+            persistent_buffer region;
+            region.storage().emplace<relay_state::pipe_region>(relay_, n);
+            region.buffer() = boost::asio::const_buffer(nullptr, n);
+            peer->write(region);
+        }
+        else if (n == 0)
+        {
+            check(boost::asio::error::eof);
+            return;
+        }
+        else if (errno == EAGAIN && used == 0)
+        {
+            socket_.async_wait(socket::wait_read, [self = shared_from_this()](const boost::system::error_code& ec)
+            {
+                if (self->check(ec)) self->read();
+            });
+            return;
+        }
+        else if (errno == EAGAIN)
+        {
+            // The pipe is full, maybe of fragments before capacity. Park with a reference to keep
+            // alive, drained() re-arms if it sees full, otherwise this sees the room.
+            r.waiting = shared_from_this();
+            r.full.store(true);
+            if (r.in_pipe.load() >= used || !r.full.exchange(false)) return;
+            r.waiting.reset();
+        }
+        else if (!r.spliced && (errno == EINVAL || errno == ENOSYS || errno == EOPNOTSUPP))
+        {
+            // the socket type does not support splice
+            r.close_pipe();
+            return relay_copy();
+        }
+        else
+        {
+            check(boost::system::error_code(errno, boost::system::system_category()));
+            return;
+        }
+    }
+#endif
+}
+
+void session::relay_copy()
+{
+    auto chunk = relay_->take();
+    auto b = boost::asio::buffer(chunk.get(), relay_state::chunk_size);
+    socket_.async_read_some(b, CALLBACK(chunk = std::move(chunk)) mutable
+    {
+        if (!self->check(ec)) return;
+        auto peer = self->relay_->peer.lock();
+        if (!peer) return self->close();
+
+        persistent_buffer b;
+        auto& storage = b.storage().emplace<relay_state::pooled_chunk>(self->relay_, std::move(chunk));
+        b.buffer() = boost::asio::buffer(storage.data.get(), bytes_transferred);
+        peer->write(b);
+        self->read();
+    });
+}
+
+void session::dispatch_frame()
+{
+    if (has_options(protocol_options_, protocol_options::batch_frames))
+        frames_.push_back(buf_);
+    else
+        handler()->read(this, buf_);
+}
+
+bool session::deliver()
+{
+    // Must be called before the storage of buf_ is prepared for the next read. Returns true if
+    // any frame is delivered, then parse again since the handler may change protocol.
+    if (frames_.empty()) return false;
+    handler()->read_batch(this, buffer_span(frames_));
+    if (!has_options(protocol_options_, protocol_options::do_not_consume_buffer))
+    {
+        auto& last = frames_.back();
+        buf_.consume(static_cast<char*>(last.data()) + last.size() -
+                     static_cast<char*>(buf_.external_input_buffer().data()));
+    }
+    frames_.clear();
+    return true;
+}
+
+bool session::read_some(std::size_t bufsize)
 {
     assert(bufsize <= read_buffer_size_);
     if(buf_.internal_input_buffer().size() > 0)
     {
         buf_.commit_to_external_input(bufsize);
         buf_.move_to_new_external_input_segment();
-        handler()->read(this, buf_);
-        read();
+        dispatch_frame();
+        return true;
     }
     else
     {
+        if (deliver()) return true;
         socket_.async_read_some(buf_.prepare_output_buffer(bufsize), CALLBACK()
         {
             if (!self->check(ec)) return;
             self->buf_.commit_to_internal_input(bytes_transferred);
             self->buf_.commit_whole_internal_input();
             self->buf_.move_to_new_external_input_segment();
-            self->handler()->read(self.get(), self->buf_);
+            self->dispatch_frame();
             self->read();
         });
+        return false;
     }
 }
 
-void session::read_fixed(std::size_t bufsize)
+bool session::read_fixed(std::size_t bufsize)
 {
     assert(bufsize <= read_buffer_size_);
     const std::size_t remaining = buf_.internal_input_buffer().size();
@@ -542,72 +1843,84 @@ void session::read_fixed(std::size_t bufsize)
     {
         buf_.commit_to_external_input(bufsize);
         buf_.move_to_new_external_input_segment();
-        handler()->read(this, buf_);
-        read();
+        dispatch_frame();
+        return true;
     }
     else
     {
-        boost::asio::async_read(socket_, buf_.prepare_output_buffer(bufsize - remaining), CALLBACK()
+        if (deliver()) return true;
+        const std::size_t sz = bufsize - remaining;
+        boost::asio::async_read(socket_, buf_.prepare_output_buffer((std::max)(sz, read_ahead_size_)),
+                                boost::asio::transfer_at_least(sz), CALLBACK(bufsize)
         {
             if (!self->check(ec)) return;
+            // bytes read ahead are left in the internal input for the following frames
             self->buf_.commit_to_internal_input(bytes_transferred);
-            self->buf_.commit_whole_internal_input();
+            self->buf_.commit_to_external_input(bufsize);
             self->buf_.move_to_new_external_input_segment();
-            self->handler()->read(self.get(), self->buf_);
+            self->dispatch_frame();
             self->read();
         });
+        return false;
     }
 }
 
-void session::read_delim(char delim)
+bool session::read_delim(char delim)
 {
-    std::string s;
-    s.push_back(delim);
-    read_delim(s);
+    return read_delim(&delim, 1);
 }
 
-void session::read_delim(const std::string& delim)
+bool session::read_delim(const std::string& delim)
 {
-    std::size_t delim_length = delim.size();
-    if (delim_length == 0) return read_some(read_buffer_size_);
+    return read_delim(delim.data(), delim.size());
+}
 
-    const bool ignore = has_options(protocol_options_, protocol_options::ignore_protocol_bytes);
-    auto callback = CALLBACK(delim_length, ignore)
-    {
-        if (!self->check(ec)) return;
+bool session::read_delim(const char* delim, std::size_t delim_length)
+{
+    if (delim_length == 0) return read_some(read_buffer_size_);
 
-#ifdef BOOST_ASIO_NO_DYNAMIC_BUFFER_V1
-        // Unlike DynamicBuffer_v1, the whole output buffer of DynamicBuffer_v2 contains valid data
-        // since it had been shrunk before the callback. So commit the whole output buffer.
-        self->buf_.commit_to_internal_input(self->buf_.output_buffer().size());
-#endif
-        // buf has already been committed and bytes_transferred is the length from the beginning of
-        // internal input to the delimiter (including), so it may be smaller than the size of internal input.
-        self->buf_.commit_to_external_input(bytes_transferred - delim_length * ignore);
-        self->buf_.move_to_new_external_input_segment();
-        self->handler()->read(self.get(), self->buf_);
-        self->buf_.commit_to_external_input(delim_length * ignore);
-        self->read();
-    };
+    const std::size_t remaining = buf_.internal_input_buffer().size();
+    auto p = static_cast<const char*>(buf_.internal_input_buffer().data());
 
-#ifdef BOOST_ASIO_NO_DYNAMIC_BUFFER_V1
-    // DynamicBuffer_v2 treats the output buffer as valid data, so remove it before read.
-    buf_.shrink_output_buffer(buf_.output_buffer().size());
-#endif
+    // resume from where the previous scan stopped, a partial delimiter may span the boundary
+    std::size_t from = (std::min)(delim_scanned_, remaining);
+    std::size_t pos = from + find_delim(p + from, remaining - from, delim, delim_length);
 
-    if (delim_length == 1)
+    if (pos < remaining)
     {
-        boost::asio::async_read_until(socket_, dynamic_buffer_adaptor{buf_, read_buffer_size_},
-                                      delim[0], std::move(callback));
+        const bool ignore = has_options(protocol_options_, protocol_options::ignore_protocol_bytes);
+        delim_scanned_ = 0;
+        buf_.commit_to_external_input(pos + delim_length * !ignore);
+        buf_.move_to_new_external_input_segment();
+        dispatch_frame();
+        buf_.commit_to_external_input(delim_length * ignore);
+        return true;
     }
-    else
+
+    if (deliver()) return true;
+    delim_scanned_ = remaining < delim_length ? 0 : remaining - delim_length + 1;
+
+    if (remaining >= read_buffer_size_)
     {
-        boost::asio::async_read_until(socket_, dynamic_buffer_adaptor{buf_, read_buffer_size_},
-                                      delim, std::move(callback));
+        this->check(boost::asio::error::not_found);
+        return false;
     }
+
+    // read as much as available, the following frames are likely in the same segment
+    std::size_t sz = (std::min)(buf_.capacity() - buf_.external_input_buffer().size() - remaining,
+                                std::size_t(65536));
+    sz = (std::max)({sz, read_ahead_size_, std::size_t(512)});
+    sz = (std::min)(sz, read_buffer_size_ - remaining);
+    socket_.async_read_some(buf_.prepare_output_buffer(sz), CALLBACK()
+    {
+        if (!self->check(ec)) return;
+        self->buf_.commit_to_internal_input(bytes_transferred);
+        self->read();
+    });
+    return false;
 }
 
-void session::read_prefix(std::size_t len)
+bool session::read_prefix(std::size_t len)
 {
     const std::size_t remaining = buf_.internal_input_buffer().size();
     auto p = (const unsigned char*)buf_.internal_input_buffer().data();
@@ -622,6 +1935,7 @@ void session::read_prefix(std::size_t len)
 
     if (remaining < len || (var && (p[len - 1] & 0x80u) != 0 && (++len, true)))
     {
+        if (deliver()) return true;
         if (len > read_buffer_size_)
         {
             this->check(make_error_code(boost::system::errc::message_size));
@@ -630,16 +1944,18 @@ void session::read_prefix(std::size_t len)
         {
             std::size_t sz = len - remaining;
             if (var) len += size_msb;
-            boost::asio::async_read(socket_, buf_.prepare_output_buffer(sz), CALLBACK(len)
+            boost::asio::async_read(socket_, buf_.prepare_output_buffer((std::max)(sz, read_ahead_size_)),
+                                    boost::asio::transfer_at_least(sz), CALLBACK(len)
             {
                 if (!self->check(ec)) return;
                 self->buf_.commit_to_internal_input(bytes_transferred);
-                self->read_prefix(len);
+                if (self->read_prefix(len)) self->read();
             });
         }
     }
     else if (len > 8 + var)
     {
+        if (deliver()) return true;
         this->check(make_error_code(boost::system::errc::value_too_large));
     }
     else
@@ -677,20 +1993,25 @@ void session::read_prefix(std::size_t len)
         if (has_options(protocol_options_, protocol_options::include_prefix_in_payload) &&
             ((data_size < len) || (data_size -= len, false)))
         {
+            if (deliver()) return true;
             this->check(make_error_code(boost::system::errc::bad_message));
         }
         else if (data_size + len > read_buffer_size_)
         {
+            if (deliver()) return true;
             this->check(make_error_code(boost::system::errc::message_size));
         }
         else
         {
+            // deliver pending frames before the prefix is committed if the payload has to be read
+            if (remaining - len < data_size && deliver()) return true;
             buf_.commit_to_external_input(len);
             if (has_options(protocol_options_, protocol_options::ignore_protocol_bytes))
                 buf_.mark_current_external_input();
-            read_fixed(data_size);
+            return read_fixed(data_size);
         }
     }
+    return false;
 }
 
 
@@ -701,43 +2022,206 @@ session_manager_ptr session_manager::create()
 
 session_ptr session_manager::create(service_ptr service)
 {
-    return std::make_shared<session_impl>(std::move(service));
+    return create(std::move(service), context_ptr{});
+}
+
+session_ptr session_manager::create(service_ptr service, context_ptr ctx)
+{
+    // registered once constructed, weak_from_this() is empty in the constructor
+    session_ptr session = std::make_shared<session_impl>(std::move(service), std::move(ctx));
+    static_cast<manager_impl*>(this)->sessions.insert(session);
+    return session;
+}
+
+std::size_t session_manager::size(const context& ctx)
+{
+    return static_cast<manager_impl*>(this)->count(&ctx)->load(std::memory_order_relaxed);
 }
 
 session_ptr session_manager::get(unsigned long id)
 {
-    auto impl = static_cast<manager_impl*>(this);
-    std::lock_guard<spinlock> guard(impl->guard);
-    auto iter = impl->sessions.find(id);
-    if(iter != impl->sessions.end())
-        return iter->shared_from_this();
-    return session_ptr{};
+    return static_cast<manager_impl*>(this)->sessions.find(id);
+}
+
+std::vector<session_ptr> session_manager::snapshot()
+{
+    std::vector<session_ptr> sessions;
+    auto& registry = static_cast<manager_impl*>(this)->sessions;
+    for (std::size_t i = 0; i < registry.size(); ++i)
+    {
+        registry.scan(i, [&](const std::weak_ptr<session>& weak)
+        {
+            if (auto session = weak.lock()) sessions.push_back(std::move(session));
+            return true;
+        });
+    }
+    return sessions;
 }
 
 std::size_t session_manager::foreach(object::fn<bool(&)(session*)> f)
 {
     std::size_t c = 0;
-    auto impl = static_cast<manager_impl*>(this);
-    impl->guard.lock();
-    auto iter = impl->sessions.begin();
-    while (iter != impl->sessions.end())
+    for (auto& session : snapshot())
     {
-        auto session = iter->shared_from_this();
-        if (!session)
+        if (!f(session.get())) break;
+        ++c;
+    }
+    return c;
+}
+
+std::size_t session_manager::foreach(object::fn<bool(&)(session*)> f, context& pool)
+{
+    constexpr std::size_t chunk_size = 256;
+
+    // workers and the caller claim chunks until none is left, so the caller never waits for
+    // a worker not yet started, e.g. when it is the only thread of pool itself
+    struct state
+    {
+        std::vector<session_ptr> sessions;
+        object::fn<bool(&)(session*)> f;
+        std::size_t chunks;
+        std::atomic<std::size_t> next{0};
+        std::atomic<std::size_t> finished{0};
+        std::atomic<std::size_t> count{0};
+        std::atomic<bool> stop{false};
+        std::atomic<bool> failed{false};
+        std::exception_ptr error;
+        std::promise<void> done;
+
+        state(std::vector<session_ptr> sessions, object::fn<bool(&)(session*)> f)
+            : sessions(std::move(sessions)), f(f),
+              chunks((this->sessions.size() + chunk_size - 1) / chunk_size) {}
+
+        void run()
         {
-            iter = impl->sessions.upper_bound(iter->id());
+            for (std::size_t i; (i = next.fetch_add(1, std::memory_order_relaxed)) < chunks;)
+            {
+                std::size_t c = 0;
+                std::size_t end = (std::min)(sessions.size(), (i + 1) * chunk_size);
+                try
+                {
+                    for (std::size_t k = i * chunk_size; k < end && !stop.load(std::memory_order_relaxed); ++k)
+                    {
+                        if (f(sessions[k].get())) ++c;
+                        else stop.store(true, std::memory_order_relaxed);
+                    }
+                }
+                catch (...)
+                {
+                    // kept for the caller instead of escaping into a worker of pool
+                    if (!failed.exchange(true)) error = std::current_exception();
+                    stop.store(true, std::memory_order_relaxed);
+                }
+                count.fetch_add(c, std::memory_order_relaxed);
+                if (finished.fetch_add(1, std::memory_order_acq_rel) + 1 == chunks) done.set_value();
+            }
         }
-        else
+    };
+
+    auto st = std::make_shared<state>(snapshot(), f);
+    if (st->chunks == 0) return 0;
+    auto future = st->done.get_future();
+    std::size_t workers = (std::min)(st->chunks - 1, std::size_t((std::max)(std::thread::hardware_concurrency(), 1u)));
+    for (std::size_t i = 0; i < workers; ++i)
+        boost::asio::post(pool, [st] { st->run(); });
+    st->run();
+    future.get();
+    if (st->error) std::rethrow_exception(st->error);
+    return st->count.load(std::memory_order_relaxed);
+}
+
+std::size_t session_manager::broadcast(persistent_buffer_list& list)
+{
+    return broadcast(list, [](session*) { return true; });
+}
+
+std::size_t session_manager::broadcast(persistent_buffer_list& list, object::fn<bool(&)(session*)> filter)
+{
+    // Sessions of a shard are collected in its read phase, and filtered and written after it,
+    // so neither the callbacks nor the references dropped, which may destroy a session and
+    // erase it from the registry, run while the shard can't reclaim.
+    std::size_t c = 0;
+    std::vector<session_ptr> sessions;
+    auto& registry = static_cast<manager_impl*>(this)->sessions;
+    for (std::size_t i = 0; i < registry.size(); ++i)
+    {
+        sessions.clear();
+        registry.scan(i, [&](const std::weak_ptr<session>& weak)
+        {
+            if (auto session = weak.lock()) sessions.push_back(std::move(session));
+            return true;
+        });
+        for (auto& session : sessions)
         {
-            impl->guard.unlock();
-            if(!f(session.get())) return c;
+            if (!filter(session.get())) continue;
+            session->write(list);
             ++c;
-            auto id = session->id();
-            session = nullptr;
-            impl->guard.lock();
-            iter = impl->sessions.upper_bound(id);
         }
     }
-    impl->guard.unlock();
     return c;
 }
+
+std::future<std::size_t> session_manager::async_broadcast(persistent_buffer_list& list, object::fn<bool(session*)> filter)
+{
+    // the buffers are copied sharing storage and linked once, then read concurrently by the tasks
+    struct state
+    {
+        std::vector<persistent_buffer> buffers;
+        persistent_buffer_list list;
+        object::fn<bool(session*)> filter;
+        std::atomic<std::size_t> tasks{0};
+        std::atomic<std::size_t> count{0};
+        std::promise<std::size_t> done;
+
+        ~state()
+        {
+            list.clear();
+        }
+
+        void run(const std::vector<session_ptr>& sessions)
+        {
+            std::size_t c = 0;
+            for (auto& session : sessions)
+            {
+                if (filter && !filter(session.get())) continue;
+                session->write(list);
+                ++c;
+            }
+            count.fetch_add(c, std::memory_order_relaxed);
+            if (tasks.fetch_sub(1, std::memory_order_acq_rel) == 1)
+                done.set_value(count.load(std::memory_order_relaxed));
+        }
+    };
+
+    auto st = std::make_shared<state>();
+    st->buffers.assign(list.begin(), list.end());
+    for (auto& b : st->buffers) st->list.push_back(b);
+    st->filter = std::move(filter);
+    auto future = st->done.get_future();
+
+    // sessions grouped by context, few contexts
+    std::vector<std::pair<context*, std::vector<session_ptr>>> groups;
+    for (auto& session : snapshot())
+    {
+        context* ctx = &session->execution_context();
+        auto it = std::find_if(groups.begin(), groups.end(), [ctx](const auto& g) { return g.first == ctx; });
+        if (it == groups.end()) it = groups.insert(groups.end(), {ctx, {}});
+        it->second.push_back(std::move(session));
+    }
+
+    if (groups.empty())
+    {
+        st->done.set_value(0);
+        return future;
+    }
+
+    st->tasks.store(groups.size(), std::memory_order_relaxed);
+    for (auto& g : groups)
+    {
+        boost::asio::post(*g.first, [st, sessions = std::move(g.second)]
+        {
+            st->run(sessions);
+        });
+    }
+    return future;
+}
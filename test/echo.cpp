@@ -1,6 +1,7 @@
 #include <boost/endian/conversion.hpp>
 #include <boost/endian/buffers.hpp>
 #include <boost/crc.hpp>
+#include <cstdio>
 
 #include "utils.hpp"
 
@@ -70,6 +71,9 @@ struct header
 
 class ServerHandler : public logging::handler
 {
+    const bool read_ahead;
+    const bool cork;
+
     void except(session* session, std::exception& e) override
     {
         session->close(true);
@@ -78,6 +82,8 @@ class ServerHandler : public logging::handler
     void connect(session* session, const endpoint& ep) override
     {
         session->protocol(protocol::delim_crlf, 32);
+        if (read_ahead) session->read_ahead_size(1024);
+        if (cork) session->cork(true);
     }
 
     void read(session* session, buffer& buf) override
@@ -147,14 +153,18 @@ class ServerHandler : public logging::handler
     }
 
 public:
-    ServerHandler() noexcept : handler("server") {}
+    ServerHandler(bool read_ahead, bool cork) noexcept
+        : handler("server"), read_ahead(read_ahead), cork(cork) {}
 };
 
 class ClientHandler : public logging::handler
 {
+    const bool read_ahead;
+
     void connect(session* session, const endpoint& ep) override
     {
         session->protocol(protocol::prefix_32, protocol_options::use_little_endian);
+        if (read_ahead) session->read_ahead_size(1024);
     }
 
     void except(session* session, std::exception& e) override
@@ -181,18 +191,29 @@ class ClientHandler : public logging::handler
     }
 
 public:
-    ClientHandler() noexcept : handler("client") {}
+    explicit ClientHandler(bool read_ahead) noexcept
+        : handler("client"), read_ahead(read_ahead) {}
 };
 
 
 int main(int argc, char* argv[]) try
 {
+    // trailing options: read_ahead and cork of both ends, and a body written by sendfile
+    bool read_ahead = false, cork = false, sendfile = false;
+    for (; argc > 1; --argc)
+    {
+        if (std::strcmp(argv[argc - 1], "read_ahead") == 0) read_ahead = true;
+        else if (std::strcmp(argv[argc - 1], "cork") == 0) cork = true;
+        else if (std::strcmp(argv[argc - 1], "sendfile") == 0) sendfile = true;
+        else break;
+    }
+
     auto pair = argc <= 2 ?
-            make_endpoint_pair(argv[1] ? argv[1] : "ipv4", nullptr, nullptr) :
+            make_endpoint_pair(argc > 1 ? argv[1] : "ipv4", nullptr, nullptr) :
             make_endpoint_pair(argv[3], argv[1], argv[2]);
 
-    auto server = minapp::acceptor::create(logging::wrap<ServerHandler>());
-    auto client = minapp::connector::create(logging::wrap<ClientHandler>());
+    auto server = minapp::acceptor::create(logging::wrap<ServerHandler>(read_ahead, cork));
+    auto client = minapp::connector::create(logging::wrap<ClientHandler>(read_ahead));
 
     workers workers({server, client}, 1);
 
@@ -317,9 +338,30 @@ int main(int argc, char* argv[]) try
                 crc32.process_bytes(body.data(), body.size());
                 auto header = header::make(protocol::prefix_var, {}, crc32.checksum());
                 session->write(header, body);
+#if !defined(_WIN32)
+                p = sendfile ? protocol::prefix_32 : protocol::none;
+#else
+                p = protocol::none;
+#endif
+                break;
+            }
+
+#if !defined(_WIN32)
+            case protocol::prefix_32: {
+                const char s[] = "skipped file_region fixed";
+                std::FILE* f = std::tmpfile();
+                std::fwrite(s, 1, sizeof(s) - 1, f);
+                std::fflush(f);
+                auto body = persist(file_region{fileno(f), 8, sizeof(s) - 9, std::shared_ptr<std::FILE>(f, std::fclose)});
+                assert(body.storage().type() == object::type_id<file_region>());
+                assert(body.data() == nullptr && body.size() == 17);
+                crc32.process_bytes(s + 8, body.size());
+                auto header = header::make(protocol::fixed, protocol_options{17}, crc32.checksum());
+                session->write(header, body);  // in order with header, fclose after written
                 p = protocol::none;
                 break;
             }
+#endif
 
             default:
                 p = protocol::none;
@@ -14,6 +14,12 @@ class forward : public logging::handler
         else if (auto peer = h.lock())
         {
             peer->attrs.set("PEER", session->weak_from_this());
+            // a slow side pauses reading of the other side
+            session->write_watermarks(256 << 10, 1 << 20);
+            peer->write_watermarks(256 << 10, 1 << 20);
+            session->throttle(peer);
+            peer->throttle(session->weak_from_this());
+            session->relay(peer);
         }
         else
         {
@@ -28,7 +34,11 @@ class forward : public logging::handler
         {
             session->protocol(protocol::any);
             if (auto peer = h.lock())
-                peer->write(buf.whole());
+            {
+                // bytes buffered before the peer connected, then the kernel moves the rest
+                peer->write(buf.retain(buf.whole()));
+                session->relay(std::move(peer));
+            }
             else
                 session->close();
         }
@@ -44,7 +54,7 @@ class forward : public logging::handler
         if (session->attrs.get("PEER", h))
         {
             if (auto peer = h.lock())
-                peer->close(true);
+                peer->close();
         }
     }
 
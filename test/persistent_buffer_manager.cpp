@@ -0,0 +1,83 @@
+#include <minapp/persistent_buffer_manager.hpp>
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace minapp;
+
+/**
+ *  Stress of the lock-free write queue of sessions. Each thread manages single buffers and pairs of
+ *  one write, and then marks like a session does, writing out and clearing whatever it marked until
+ *  nothing is left. Every buffer carries its thread and sequence, which must arrive in order per
+ *  thread with the buffers of a write adjacent, by a single consumer at a time. A write may span two
+ *  marks, its last buffer is not popped while the next one is being linked by another thread.
+ */
+int main(int argc, char* argv[]) try
+{
+    const unsigned threads = argc > 1 ? std::stoul(argv[1]) : 8;
+    const unsigned writes = argc > 2 ? std::stoul(argv[2]) : 200000;
+
+    using message = std::array<unsigned, 3>;   // thread, sequence, buffers left in the write
+    persistent_buffer_manager manager;
+    std::vector<unsigned> next(threads, 0);    // touched by the consumer only
+    unsigned left = 0, writer = 0;
+    std::atomic<bool> consuming{false};
+    std::atomic<unsigned long> consumed{0};
+    std::atomic<bool> failed{false};
+
+    auto consume = [&]
+    {
+        for (long m; (m = manager.mark()) > 0;)
+        {
+            if (consuming.exchange(true)) failed = true;
+            for (auto& b : manager.marked())
+            {
+                auto& msg = *static_cast<const message*>(b.data());
+                if (b.size() != sizeof(message) || msg[0] >= threads || msg[1] != next[msg[0]]++
+                    || (left && (msg[0] != writer || msg[2] != left - 1)))
+                    failed = true;
+                left = msg[2];
+                writer = msg[0];
+                ++consumed;
+            }
+            consuming = false;
+            manager.clear_marked();
+        }
+    };
+
+    std::vector<std::thread> pool;
+    for (unsigned t = 0; t < threads; ++t) pool.emplace_back([&, t]
+    {
+        for (unsigned seq = 0; seq < writes;)
+        {
+            if (seq % 3 == 0 && seq + 2 <= writes)
+            {
+                manager.manage(persist(message{t, seq, 1}), persist(message{t, seq + 1, 0}));
+                seq += 2;
+            }
+            else
+            {
+                manager.manage(persist(message{t, seq++, 0}));
+            }
+            consume();
+        }
+    });
+    for (auto& th : pool) th.join();
+    consume();
+
+    if (failed || left) throw std::logic_error("buffers out of order or consumed concurrently");
+    if (consumed != std::uint64_t(threads) * writes) throw std::logic_error("buffers lost");
+    if (manager.size() != 0) throw std::logic_error("bytes not cleared");
+    return 0;
+}
+catch (std::exception& e)
+{
+    std::cerr << e.what() << std::endl;
+    return 1;
+}
@@ -0,0 +1,248 @@
+#include "utils.hpp"
+
+#include <minapp/pubsub.hpp>
+
+#include <atomic>
+#include <future>
+
+#if !defined(_WIN32)
+#include <sys/resource.h>
+#endif
+
+/**
+ *  Topic fan-out over prefix_32 frames. A frame body of 'S' topic subscribes the session,
+ *  'U' topic unsubscribes it, and 'P' len topic payload publishes the frame as is to the
+ *  subscribers of topic, retained from the read buffer and shared by all of them.
+ *
+ *  The benchmark connects @p subscribers sessions spread over @p topics, and one publisher
+ *  sends @p messages frames to each topic, then reports the deliveries to subscribers.
+ *
+ *  Usage: pubsub [subscribers] [messages] [payload bytes] [topics] [queue|drop|disconnect] [threads]
+ */
+class server : public minapp::handler
+{
+    pubsub_ptr hub_;
+    pubsub::slow_consumer policy_;
+
+    void connect(session* session, const endpoint& ep) override
+    {
+        session->protocol(protocol::prefix_32);
+        // a subscriber may fall behind by this many bytes before the policy applies
+        hub_->slow_consumer_policy(session, policy_, 1 << 20);
+    }
+
+    void read(session* session, buffer& buf) override
+    {
+        // the frame includes its length prefix, which is forwarded as well
+        auto body = static_cast<const char*>(buf.data()) + 4;
+        std::size_t size = buf.size() - 4;
+        if (size < 1) throw std::invalid_argument("empty frame");
+        switch (body[0])
+        {
+        case 'S':
+            hub_->subscribe(session, std::string_view(body + 1, size - 1));
+            break;
+        case 'U':
+            hub_->unsubscribe(session, std::string_view(body + 1, size - 1));
+            break;
+        case 'P':
+        {
+            std::size_t len = size > 1 ? static_cast<unsigned char>(body[1]) : 0;
+            if (size < 2 + len) throw std::invalid_argument("bad topic length");
+            hub_->publish(std::string_view(body + 2, len), buf.retain());
+            break;
+        }
+        default:
+            throw std::invalid_argument("unknown command");
+        }
+    }
+
+    void except(session* session, std::exception& e) override
+    {
+        session->close(true);
+    }
+
+public:
+    server(pubsub_ptr hub, pubsub::slow_consumer policy) : hub_(std::move(hub)), policy_(policy) {}
+};
+
+// messages received by a subscriber session
+struct received
+{
+    std::atomic<std::size_t> count{0};
+};
+
+class subscriber : public minapp::handler
+{
+    std::atomic<std::size_t>& delivered_;
+
+    void connect(session* session, const endpoint& ep) override
+    {
+        session->protocol(protocol::prefix_32);
+    }
+
+    void read(session* session, buffer& buf) override
+    {
+        delivered_.fetch_add(1, std::memory_order_relaxed);
+        session->servlet<received>()->count.fetch_add(1, std::memory_order_relaxed);
+    }
+
+public:
+    explicit subscriber(std::atomic<std::size_t>& delivered) : delivered_(delivered) {}
+};
+
+static std::vector<char> frame(char command, const std::string& topic, std::size_t payload = 0)
+{
+    std::size_t body = 1 + (command == 'P') + topic.size() + payload;
+    std::vector<char> f(4 + body, 'x');
+    for (int k = 3; k >= 0; --k) f[k] = static_cast<char>((body >> (8 * (3 - k))) & 0xff);
+    f[4] = command;
+    std::size_t i = 5;
+    if (command == 'P') f[i++] = static_cast<char>(topic.size());
+    std::copy(topic.begin(), topic.end(), f.begin() + i);
+    return f;
+}
+
+int main(int argc, char* argv[]) try
+{
+    const std::size_t subscribers = argc > 1 ? std::stoul(argv[1]) : 10000;
+    const std::size_t messages = argc > 2 ? std::stoul(argv[2]) : 1000;
+    const std::size_t payload = argc > 3 ? std::stoul(argv[3]) : 256;
+    const std::size_t topics = argc > 4 ? std::stoul(argv[4]) : 1;
+    const std::string policy = argc > 5 ? argv[5] : "queue";
+    const std::size_t threads = argc > 6 ? std::stoul(argv[6]) : 4;
+
+    pubsub::slow_consumer p = pubsub::slow_consumer::queue;
+    if (policy == "drop") p = pubsub::slow_consumer::drop;
+    else if (policy == "disconnect") p = pubsub::slow_consumer::disconnect;
+    else if (policy != "queue") throw std::invalid_argument("unknown policy " + policy);
+    if (topics == 0 || topics > subscribers) throw std::invalid_argument("bad topics");
+
+#if !defined(_WIN32)
+    // both ends of every subscriber are in this process
+    rlimit rl{};
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max)
+    {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+#endif
+
+    auto hub = pubsub::create();
+    std::vector<context_ptr> pool;
+    for (std::size_t i = 0; i < threads; ++i) pool.push_back(make_context(1));
+    auto srv = minapp::acceptor::create(std::make_shared<server>(hub, p), std::move(pool));
+    std::atomic<std::size_t> delivered{0};
+    // subscribers are read by as many single threaded contexts as the server
+    std::vector<service_ptr> services{srv};
+    for (std::size_t i = 0; i < threads; ++i)
+        services.push_back(minapp::connector::create(std::make_shared<subscriber>(delivered), make_context(1)));
+
+    workers workers(services, 1);
+
+    auto pair = make_endpoint_pair("ipv4", nullptr, nullptr);
+    srv->bind(pair.first);
+
+    std::vector<std::string> names;
+    for (std::size_t t = 0; t < topics; ++t) names.push_back("topic/" + std::to_string(t));
+
+    std::vector<session_ptr> sessions;
+    sessions.reserve(subscribers);
+    for (std::size_t i = 0; i < subscribers; ++i)
+    {
+        sessions.push_back(services[1 + i % threads]->connect(pair.second).get());
+        sessions.back()->write(frame('S', names[i % topics]));
+    }
+
+    auto subscribed = [&]
+    {
+        std::size_t n = 0;
+        for (auto& name : names) n += hub->subscribers(name);
+        return n;
+    };
+    for (auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(30); subscribed() < subscribers;)
+    {
+        if (std::chrono::steady_clock::now() > deadline) throw std::runtime_error("subscribe timeout");
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+
+    // the frames of each topic are persisted once and written repeatedly without copy
+    std::vector<persistent_buffer> frames;
+    for (auto& name : names) frames.push_back(persist(frame('P', name, payload)));
+    auto publisher = services[1]->connect(pair.second).get();
+
+    const std::size_t expected = subscribers * messages;
+    auto start = std::chrono::steady_clock::now();
+    for (std::size_t m = 0; m < messages; ++m)
+        for (auto& f : frames) publisher->write(f);
+
+    // every message is either delivered or dropped for a slow subscriber
+    std::size_t last = 0;
+    auto idle = std::chrono::steady_clock::now();
+    while (delivered.load() + hub->dropped() < expected)
+    {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        auto now = std::chrono::steady_clock::now();
+        if (std::size_t d = delivered.load(); d != last) last = d, idle = now;
+        else if (now - idle > std::chrono::seconds(p == pubsub::slow_consumer::disconnect ? 1 : 30)) break;
+    }
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+    const std::size_t frame_size = frames.front().size();
+    std::cout << "subscribers = " << subscribers << ", topics = " << topics << ", messages = " << messages
+              << ", delivered = " << delivered.load() << ", dropped = " << hub->dropped()
+              << ", elapsed = " << elapsed.count() << "s, "
+              << delivered.load() / elapsed.count() << " deliveries/s, "
+              << delivered.load() * frame_size / elapsed.count() / (1 << 20) << " MiB/s" << std::endl;
+
+    if (p == pubsub::slow_consumer::queue && delivered.load() != expected)
+        throw std::logic_error("lost messages");
+    if (p == pubsub::slow_consumer::drop)
+    {
+        if (hub->dropped() == 0) throw std::logic_error("no slow consumer dropped");
+        if (delivered.load() + hub->dropped() != expected) throw std::logic_error("lost messages");
+    }
+    if (p == pubsub::slow_consumer::disconnect)
+    {
+        // the server closes slow subscribers, which see the end of stream and close too, the
+        // others receive every message of their topic
+        auto closed = [&]
+        {
+            std::size_t n = 0;
+            for (auto& s : sessions) n += s->status() == status::closed;
+            return n;
+        };
+        auto settled = [&]
+        {
+            for (auto& s : sessions)
+                if (s->status() != status::closed && s->servlet<received>()->count.load() != messages)
+                    return false;
+            return true;
+        };
+        for (auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(10);
+             !settled() && std::chrono::steady_clock::now() < deadline;)
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        if (closed() == 0) throw std::logic_error("no slow consumer disconnected");
+        if (!settled()) throw std::logic_error("slow consumer not disconnected");
+    }
+
+    for (auto& s : sessions) s->close(true);
+    publisher->close(true);
+
+    // the server sessions of closed subscribers leave their topics without another publish()
+    for (auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(10);
+         subscribed() > 0 && std::chrono::steady_clock::now() < deadline;)
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    if (subscribed() > 0) throw std::logic_error("closed subscribers not pruned");
+    return 0;
+}
+catch (boost::system::system_error& e)
+{
+    std::cerr << e.code() << ' ' << '-' << ' ' << e.what() << std::endl;
+    return 1;
+}
+catch (std::exception& e)
+{
+    std::cerr << e.what() << std::endl;
+    return 1;
+}
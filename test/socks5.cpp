@@ -22,6 +22,16 @@ class socks5 : public logging::handler
 
             peer->attrs.set("PEER", session->weak_from_this());
 
+            // a slow side pauses reading of the other side
+            session->write_watermarks(256 << 10, 1 << 20);
+            peer->write_watermarks(256 << 10, 1 << 20);
+            session->throttle(peer);
+            peer->throttle(session->weak_from_this());
+            session->relay(peer);
+
+            // the handshake is done, a relayed connection may be quiet for long
+            peer->read_timeout(std::chrono::milliseconds(0));
+
             auto& remote = reinterpret_cast<tcp::endpoint const&>(ep);
 
             if (remote.address().is_v4())
@@ -68,6 +78,8 @@ class socks5 : public logging::handler
         else // client -> socks5
         {
             session->protocol(protocol::fixed, 1);
+            // a client stuck in the handshake is closed
+            session->read_timeout(std::chrono::seconds(10));
         }
     }
 
@@ -85,7 +97,10 @@ class socks5 : public logging::handler
         if (session_handle h; session->attrs.get("PEER", h))
         {
             if (auto peer = h.lock())
-                peer->write(buf);
+            {
+                peer->write(buf.retain());
+                session->relay(std::move(peer));
+            }
             else
                 session->close();
             return;
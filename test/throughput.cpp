@@ -0,0 +1,226 @@
+#include "utils.hpp"
+
+#include <future>
+
+/**
+ *  Loopback throughput: the client streams @p total bytes as a sequence of
+ *  @p frame sized frames, and the server reads them back with the selected
+ *  protocol and reports the rate. With reply it is an echo, and the rates of builds with
+ *  and without MINAPP_IO_URING compare the reactors, which is printed as backend.
+ *
+ *  Usage: throughput [any|prefix_32|delim_crlf] [total MiB] [frame bytes] [protocol] [read_ahead] [batch]
+ *                    [batch=forward] [threads] [reply] [cork] [retain] [coalesce=bytes] [zerocopy=bytes] [pool=contexts]
+ *                    [balance=hash_remote|reuse_port|reuse_port_cpu] [accepts=pending] [budget=frames]
+ */
+class sink : public minapp::handler
+{
+    enum protocol protocol_;
+    enum protocol_options options_;
+    std::size_t read_ahead_;
+    bool forward_;
+    bool reply_;
+    bool cork_;
+    bool retain_;
+    std::size_t coalesce_;
+    std::size_t zerocopy_;
+    std::size_t budget_;
+    std::size_t total_;
+    std::size_t bytes_ = 0;
+    std::size_t frames_ = 0;
+    std::size_t writes_ = 0;
+    session_ptr session_;
+    std::chrono::steady_clock::time_point start_;
+    std::promise<void> done_;
+
+    void connect(session* session, const endpoint& ep) override
+    {
+        session->protocol(protocol_, options_);
+        session->read_ahead_size(read_ahead_);
+        session->cork(cork_);
+        session->coalesce_threshold(coalesce_);
+        session->zerocopy_threshold(zerocopy_);
+        session->read_budget(budget_);
+        session_ = session->shared_from_this();
+        start_ = std::chrono::steady_clock::now();
+    }
+
+    void read(session* session, buffer& buf) override
+    {
+        bytes_ += buf.whole().size();
+        ++frames_;
+        if (reply_) answer(session, retain_ ? buf.retain() : persist(buf));
+        if (bytes_ >= total_) done_.set_value();
+    }
+
+    void read_batch(session* session, buffer_span frames) override
+    {
+        // the default, read() of each frame
+        if (forward_) return handler::read_batch(session, frames);
+        for (auto& frame : frames) bytes_ += frame.size();
+        for (auto& frame : frames) if (reply_) answer(session, retain_ ? session->retain(frame) : persist(frame));
+        frames_ += frames.size();
+        if (bytes_ >= total_) done_.set_value();
+    }
+
+    void write(session* session, persistent_buffer_list& list) override
+    {
+        ++writes_;
+    }
+
+    void answer(session* session, persistent_buffer frame)
+    {
+        session->write(static_cast<std::uint64_t>(frames_));
+        session->write(frame);
+    }
+
+public:
+    sink(enum protocol protocol, enum protocol_options options, std::size_t read_ahead, bool forward,
+         bool reply, bool cork, bool retain, std::size_t coalesce, std::size_t zerocopy,
+         std::size_t budget, std::size_t total)
+        : protocol_(protocol), options_(options), read_ahead_(read_ahead), forward_(forward),
+          reply_(reply), cork_(cork), retain_(retain), coalesce_(coalesce), zerocopy_(zerocopy),
+          budget_(budget), total_(total) {}
+
+    void wait()
+    {
+        done_.get_future().get();
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start_;
+        std::cout << "backend = " << context_backend() << ", bytes = " << bytes_ << ", frames = " << frames_
+                  << ", elapsed = " << elapsed.count() << "s, "
+                  << bytes_ / elapsed.count() / (1 << 20) << " MiB/s, "
+                  << frames_ / elapsed.count() << " frames/s";
+        if (reply_) std::cout << ", writes = " << writes_
+                              << ", coalesced = " << session_->bytes_coalesced()
+                              << ", in place = " << session_->bytes_in_place()
+                              << ", zerocopy = " << session_->bytes_zerocopy();
+        std::cout << std::endl;
+    }
+};
+
+class pump : public minapp::handler
+{
+    boost::asio::const_buffer block_;
+    std::size_t remaining_;
+
+    void send(session* session, std::size_t n)
+    {
+        for (; n > 0 && remaining_ > 0; --n)
+        {
+            auto b = boost::asio::buffer(block_, remaining_);
+            remaining_ -= b.size();
+            session->write(b);
+        }
+    }
+
+    void connect(session* session, const endpoint& ep) override
+    {
+        session->protocol(protocol::any);
+        send(session, 16);
+    }
+
+    void write(session* session, persistent_buffer_list& list) override
+    {
+        send(session, std::distance(list.begin(), list.end()));
+    }
+
+public:
+    pump(boost::asio::const_buffer block, std::size_t total)
+        : block_(block), remaining_(total) {}
+};
+
+int main(int argc, char* argv[]) try
+{
+    const std::string mode = argc > 1 ? argv[1] : "any";
+    const std::size_t total = (argc > 2 ? std::stoul(argv[2]) : 256) << 20;
+    const std::size_t frame = argc > 3 ? std::stoul(argv[3]) : 256;
+    auto pair = make_endpoint_pair(argc > 4 ? argv[4] : "ipv4", nullptr, nullptr);
+    std::size_t read_ahead = 0;
+    std::size_t threads = 1;
+    bool forward = false;
+    bool reply = false;
+    bool cork = false;
+    bool retain = false;
+    std::size_t coalesce = 512;
+    std::size_t zerocopy = 0;
+    std::size_t pool = 0;
+    std::size_t accepts = 1;
+    std::size_t budget = 64;
+    // hash of the client endpoint likely moves the accepted socket out of the listening context
+    auto balance = minapp::acceptor::balance::hash_remote;
+    protocol_options options{};
+    for (int i = 5; i < argc; ++i)
+    {
+        if (std::strcmp(argv[i], "read_ahead") == 0) read_ahead = 65536;
+        else if (std::strcmp(argv[i], "batch") == 0) options |= protocol_options::batch_frames;
+        else if (std::strcmp(argv[i], "batch=forward") == 0) options |= protocol_options::batch_frames, forward = true;
+        else if (std::strcmp(argv[i], "threads") == 0) threads = 4;
+        else if (std::strcmp(argv[i], "reply") == 0) reply = true;
+        else if (std::strcmp(argv[i], "cork") == 0) cork = true;
+        else if (std::strcmp(argv[i], "retain") == 0) retain = true;
+        else if (std::strncmp(argv[i], "coalesce=", 9) == 0) coalesce = std::stoul(argv[i] + 9);
+        else if (std::strncmp(argv[i], "zerocopy=", 9) == 0) zerocopy = std::stoul(argv[i] + 9);
+        else if (std::strncmp(argv[i], "pool=", 5) == 0) pool = std::stoul(argv[i] + 5);
+        else if (std::strncmp(argv[i], "accepts=", 8) == 0) accepts = std::stoul(argv[i] + 8);
+        else if (std::strncmp(argv[i], "budget=", 7) == 0) budget = std::stoul(argv[i] + 7);
+        else if (std::strcmp(argv[i], "balance=reuse_port") == 0) balance = minapp::acceptor::balance::reuse_port;
+        else if (std::strcmp(argv[i], "balance=reuse_port_cpu") == 0) balance = minapp::acceptor::balance::reuse_port_cpu;
+        else if (std::strcmp(argv[i], "balance=hash_remote") == 0) balance = minapp::acceptor::balance::hash_remote;
+        else throw std::invalid_argument(std::string("unknown option ") + argv[i]);
+    }
+
+    enum protocol p = protocol::any;
+    if (mode == "prefix_32") p = protocol::prefix_32;
+    else if (mode == "delim_crlf") p = protocol::delim_crlf;
+    else if (mode != "any") throw std::invalid_argument("unknown mode " + mode);
+
+    if (frame < 4) throw std::invalid_argument("frame too small");
+
+    // one block of back-to-back frames, written repeatedly without copy;
+    // protocol::any writes each frame on its own to keep the reads small
+    std::vector<char> block(p == protocol::any ? frame : (65536 / frame) * frame, 'x');
+    for (std::size_t i = 0; i < block.size(); i += frame)
+    {
+        if (p == protocol::prefix_32)
+        {
+            std::uint32_t len = static_cast<std::uint32_t>(frame - 4);
+            for (int k = 3; k >= 0; --k, len >>= 8) block[i + k] = static_cast<char>(len & 0xff);
+        }
+        else if (p == protocol::delim_crlf)
+        {
+            block[i + frame - 2] = '\r';
+            block[i + frame - 1] = '\n';
+        }
+    }
+
+    auto s = std::make_shared<sink>(p, options, read_ahead, forward, reply, cork, retain, coalesce, zerocopy, budget, total);
+    std::vector<context_ptr> contexts;
+    for (std::size_t i = 0; i < (std::max)(pool, std::size_t(1)); ++i) contexts.push_back(make_context(threads));
+    auto server = minapp::acceptor::create(s, std::move(contexts), balance);
+    server->pending_accepts(accepts);
+    auto client = minapp::connector::create(std::make_shared<pump>(boost::asio::buffer(block), total), make_context(threads));
+
+    workers workers({server, client}, threads);
+
+    server->bind(pair.first);
+    auto session = client->connect(pair.second).get();
+    s->wait();
+    session->close(true);
+    if (server->accepted() != 1) throw std::logic_error("accepted " + std::to_string(server->accepted()));
+
+    return 0;
+}
+catch (boost::system::system_error& e)
+{
+    std::cerr << e.code() << ' ' << '-' << ' ' << e.what() << std::endl;
+    return 1;
+}
+catch (std::exception& e)
+{
+    std::cerr << e.what() << std::endl;
+    return 1;
+}
+catch (...)
+{
+    std::cerr << "unknown exception" << std::endl;
+    throw;
+}
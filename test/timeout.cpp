@@ -0,0 +1,220 @@
+#include "utils.hpp"
+
+#include <atomic>
+
+/**
+ *  Session timeouts of the timing wheel. The server closes a session nothing is read from for
+ *  500 ms, and one whose write makes no progress for 500 ms. Of three clients, a silent one and
+ *  one not reading a large reply time out, while one sending a byte every 100 ms stays until it
+ *  stops sending.
+ *
+ *  A relay times out in the same way, but not while bytes move through it either way.
+ *
+ *  Then work posted and timers set to a session run in its strand, and close cancels them.
+ */
+class server : public minapp::handler
+{
+    std::atomic<int>& timed_out_;
+    const persistent_buffer reply_ = persist(std::string(64 << 20, 'x'));
+
+    void connect(session* session, const endpoint& ep) override
+    {
+        session->protocol(protocol::any);
+        session->read_timeout(std::chrono::milliseconds(500));
+        session->write_timeout(std::chrono::milliseconds(500));
+    }
+
+    void read(session* session, buffer& buf) override
+    {
+        // a client asking for a reply it never reads
+        if (static_cast<const char*>(buf.data())[0] == 'W')
+        {
+            session->read_timeout(std::chrono::milliseconds(0));
+            session->write(reply_);
+        }
+    }
+
+    void error(session* session, boost::system::error_code ec) override
+    {
+        if (ec == boost::asio::error::timed_out) ++timed_out_;
+    }
+
+public:
+    explicit server(std::atomic<int>& timed_out) : timed_out_(timed_out) {}
+};
+
+/// Relays accepted sessions to upstream as test/forward.cpp, with read timeouts at both ends.
+class relay : public minapp::handler
+{
+    using session_handle = std::weak_ptr<session>;
+
+    const endpoint upstream_;
+    std::atomic<int>& timed_out_;
+
+    void connect(session* session, const endpoint& ep) override
+    {
+        session->read_timeout(std::chrono::milliseconds(500));
+        session_handle h;
+        if (!session->attrs.get("PEER", h))
+        {
+            session->service()->connect(upstream_, { {"PEER", session->weak_from_this()} });
+        }
+        else if (auto peer = h.lock())
+        {
+            peer->attrs.set("PEER", session->weak_from_this());
+            session->relay(peer);
+        }
+        else
+        {
+            session->close(true);
+        }
+    }
+
+    void read(session* session, buffer& buf) override
+    {
+        session_handle h;
+        if (session->attrs.get("PEER", h))
+        {
+            session->protocol(protocol::any);
+            if (auto peer = h.lock())
+            {
+                peer->write(buf.retain(buf.whole()));
+                session->relay(std::move(peer));
+            }
+            else
+                session->close();
+        }
+        else
+        {
+            session->protocol(protocol::any, protocol_options::do_not_consume_buffer);
+        }
+    }
+
+    void error(session* session, boost::system::error_code ec) override
+    {
+        if (ec == boost::asio::error::timed_out) ++timed_out_;
+    }
+
+    void close(session* session) override
+    {
+        session_handle h;
+        if (session->attrs.get("PEER", h))
+        {
+            if (auto peer = h.lock())
+                peer->close();
+        }
+    }
+
+public:
+    relay(endpoint upstream, std::atomic<int>& timed_out) : upstream_(std::move(upstream)), timed_out_(timed_out) {}
+};
+
+class echo : public minapp::handler
+{
+    void read(session* session, buffer& buf) override
+    {
+        session->write(buf.retain());
+    }
+};
+
+int main(int argc, char* argv[]) try
+{
+    std::atomic<int> timed_out{0};
+    std::atomic<int> relay_timed_out{0};
+    auto srv = minapp::acceptor::create(std::make_shared<server>(timed_out), make_context(1));
+    auto client = minapp::connector::create(handler::dummy(), make_context(1));
+    auto upstream = minapp::acceptor::create(std::make_shared<echo>(), make_context(1));
+    auto relays = minapp::acceptor::create(std::make_shared<relay>(make_endpoint(false, "ipv4", 2335), relay_timed_out),
+                                           make_context(1));
+    workers workers({srv, client, upstream, relays}, 1);
+
+    auto pair = make_endpoint_pair("ipv4", nullptr, nullptr);
+    srv->bind(pair.first);
+
+    auto silent = client->connect(pair.second).get();
+    auto pinging = client->connect(pair.second).get();
+    auto stalled = client->connect(pair.second).get();
+    stalled->pause_read();
+    stalled->write(std::string("W"));
+
+    auto start = std::chrono::steady_clock::now();
+    auto elapsed = [&] { return std::chrono::steady_clock::now() - start; };
+    while (elapsed() < std::chrono::milliseconds(2000))
+    {
+        pinging->write(std::string("k"));
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    }
+
+    if (timed_out.load() != 2) throw std::logic_error("silent and stalled sessions not timed out");
+    if (silent->status() != status::closed) throw std::logic_error("silent session not closed");
+    if (pinging->status() >= status::closing) throw std::logic_error("active session timed out");
+
+    // quiet from now on
+    while (timed_out.load() < 3 && elapsed() < std::chrono::seconds(5))
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    if (timed_out.load() != 3) throw std::logic_error("pinging session not timed out after it stopped");
+
+    for (auto& s : {silent, pinging, stalled}) s->close(true);
+
+    // both ends of the relay read every 100 ms, the pings and their echoes
+    upstream->bind(make_endpoint(true, "ipv4", 2335));
+    relays->bind(make_endpoint(true, "ipv4", 2334));
+    auto tunnel = client->connect(make_endpoint(false, "ipv4", 2334)).get();
+    for (start = std::chrono::steady_clock::now(); elapsed() < std::chrono::milliseconds(2000);)
+    {
+        tunnel->write(std::string("k"));
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    }
+    if (relay_timed_out.load() != 0 || tunnel->status() >= status::closing)
+        throw std::logic_error("active relay timed out");
+
+    // a stream keeps the relay busy, moving bytes without waiting for the sockets
+    const auto block = persist(std::string(64 << 10, 's'));
+    for (start = std::chrono::steady_clock::now(); elapsed() < std::chrono::milliseconds(2000);)
+    {
+        if (tunnel->write_queue_size() < (1 << 20)) tunnel->write(block);
+        else std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    if (relay_timed_out.load() != 0 || tunnel->status() >= status::closing)
+        throw std::logic_error("streaming relay timed out");
+    while (tunnel->status() != status::closed && elapsed() < std::chrono::seconds(5))
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    if (relay_timed_out.load() == 0 || tunnel->status() != status::closed)
+        throw std::logic_error("quiet relay not timed out");
+
+    // touched in the strand only, the server closes the session 500 ms later
+    auto worker = client->connect(pair.second).get();
+    int serialized = 0;
+    std::promise<void> done;
+    for (int i = 0; i < 1000; ++i) worker->post([&] { ++serialized; });
+    for (int i = 0; i < 100; ++i) worker->after(std::chrono::milliseconds(i), [&] { ++serialized; });
+    worker->dispatch([&] { ++serialized; });
+    worker->after(std::chrono::milliseconds(200), [&] { done.set_value(); });
+    if (done.get_future().wait_for(std::chrono::seconds(5)) != std::future_status::ready)
+        throw std::logic_error("timer not fired");
+    if (serialized != 1101) throw std::logic_error("posted work lost");
+
+    // a pending timer holds the session until close cancels it
+    bool fired = false;
+    worker->after(std::chrono::seconds(30), [&] { fired = true; });
+    std::promise<void> armed;
+    worker->post([&] { armed.set_value(); });
+    armed.get_future().wait();
+    std::weak_ptr<session> weak = worker;
+    worker->close(true);
+    worker.reset();
+    for (start = std::chrono::steady_clock::now(); !weak.expired() && elapsed() < std::chrono::seconds(5);)
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    if (!weak.expired() || fired) throw std::logic_error("timer not cancelled by close");
+    return 0;
+}
+catch (boost::system::system_error& e)
+{
+    std::cerr << e.code() << ' ' << '-' << ' ' << e.what() << std::endl;
+    return 1;
+}
+catch (std::exception& e)
+{
+    std::cerr << e.what() << std::endl;
+    return 1;
+}
@@ -209,17 +209,38 @@ class logging final : public noexcept_handler_impl
         h->read(session, buf);
     }
 
+    void read_batch_impl(session* session, buffer_span frames) override
+    {
+        if (h->log_read()) for(auto& buf : frames)
+        {
+            std::size_t size = buf.size();
+            const void* p = buf.data();
+            hexdump{NSLOG(READ) << "bufsize = " << size << '\n'}(p, size);
+        }
+        h->read_batch(session, frames);
+    }
+
     void write_impl(session* session, persistent_buffer_list& list) override
     {
         if (h->log_write()) for(auto& buf : list)
         {
             std::size_t size = buf.size();
             const void* p = buf.data();
-            hexdump{NSLOG(WRITE) << "bufsize = " << size << '\n'}(p, size);
+            if (p == nullptr) NSLOG(WRITE) << "bufsize = " << size << " (region)";
+            else hexdump{NSLOG(WRITE) << "bufsize = " << size << '\n'}(p, size);
         }
         h->write(session, list);
     }
 
+    void watermark_impl(session* session, bool high) override
+    {
+        if (h->log_watermark())
+        {
+            NSLOG(WATERMARK) << (high ? "high" : "low") << " queued = " << session->write_queue_size();
+        }
+        h->watermark(session, high);
+    }
+
     void except_impl(session* session, std::exception& e) override
     {
         if (h->log_except())
@@ -258,6 +279,7 @@ public:
     LOGFLAG(connect)
     LOGFLAG(read)
     LOGFLAG(write)
+    LOGFLAG(watermark)
     LOGFLAG(except)
     LOGFLAG(error)
     LOGFLAG(close)
@@ -314,20 +336,29 @@ struct workers
 {
     std::vector<service_ptr> services;
     std::vector<std::thread> threads;
+    std::vector<context_ptr> contexts;
     workers(std::vector<service_ptr> services, std::size_t threads)
             : services(std::move(services))
     {
-        this->threads.reserve(this->services.size() * threads);
         for (const auto& service : this->services)
+        {
+            // all contexts of the pool of an acceptor
+            if (auto acceptor = std::dynamic_pointer_cast<minapp::acceptor>(service))
+                contexts.insert(contexts.end(), acceptor->pool().begin(), acceptor->pool().end());
+            else
+                contexts.push_back(service->context());
+        }
+        this->threads.reserve(contexts.size() * threads);
+        for (const auto& ctx : contexts)
         {
             for (std::size_t i = 0; i < threads; ++i)
-                this->threads.emplace_back(&context::run, service->context());
+                this->threads.emplace_back(&context::run, ctx);
         }
     }
     ~workers() noexcept(false)
     {
-        for (const auto& service : this->services)
-            service->context()->stop();
+        for (const auto& ctx : contexts)
+            ctx->stop();
         for (auto& th : this->threads)
             th.join();
     }